@@ -0,0 +1,79 @@
+// Compiles all headers and instantiates the templates. Used by the CMake build to check that the library builds on this platform
+
+#include "../Source/MZDataReaderException.h"
+#include "../Source/MZDataIdentifier.h"
+#include "../Source/MZDataReader.h"
+#include "../Source/MZDataWriter.h"
+#include "../Source/MZPosixFileIO.h"
+#include "../Source/MZLinesData.h"
+#include "../Source/MZLineParser.h"
+#include "../Source/MZLineReader.h"
+#include "../Source/MZReverseLineReader.h"
+#include "../Source/MZRecordReader.h"
+#include "../Source/MZFieldTokenizer.h"
+#include "../Source/MZLineStreamOps.h"
+#include "../Source/MZLinePipeline.h"
+#include "../Source/MZLinesEditor.h"
+#include "../Source/MZCompressedLinesData.h"
+#include "../Source/MZSharedLinesData.h"
+#include "../Source/MZFileBackedLinesData.h"
+#include "../Source/MZNewLineConverter.h"
+
+namespace
+{
+  struct Line
+  {
+    Line(const BYTE* p, DWORD len, MZDR::NewLine nl, BYTE nlBytes)
+      : pLine(p)
+      , lenght(len)
+      , newLine(nl)
+      , nBytesForNewLine(nlBytes)
+    {
+    }
+
+    const BYTE* GetLineData() const { return pLine; }
+    DWORD GetLineDataLength() const { return lenght + nBytesForNewLine; }
+
+    const BYTE* pLine;
+    DWORD lenght;
+    MZDR::NewLine newLine;
+    BYTE nBytesForNewLine;
+  };
+}
+
+typedef MZDR::LinesData<Line> LinesDataType;
+
+template class MZDR::LinesData<Line>;
+template class MZDR::LineReaderT<char, LinesDataType>;
+template class MZDR::LineReaderT<wchar_t, LinesDataType>;
+template class MZDR::ReverseLineReaderT<char, LinesDataType>;
+template class MZDR::ReverseLineReaderT<wchar_t, LinesDataType>;
+template class MZDR::RecordReaderT<LinesDataType>;
+template class MZDR::FieldTokenizerT<char, LinesDataType>;
+template class MZDR::FieldTokenizerT<wchar_t, LinesDataType>;
+template class MZDR::LinesEditViewT<char, LinesDataType>;
+template class MZDR::LinesEditViewT<wchar_t, LinesDataType>;
+template class MZDR::CompressedLinesDataT<char, LinesDataType>;
+template class MZDR::SharedLinesDataT<char, LinesDataType>;
+template class MZDR::FileBackedLinesDataT<char, LinesDataType>;
+template class MZDR::NewLineDataWriter<char>;
+template class MZDR::MemoryDataWriter<char>;
+
+void HeaderCheck()
+{
+  std::shared_ptr<LinesDataType> spLines;
+  MZDR::LineParser parser;
+
+  MZDR::FileDataReader reader(_T("input.txt"));
+  MZDR::LineReaderT<char, LinesDataType> lineReader;
+  spLines = lineReader.ReadLinesFromDataReader(&reader, &parser);
+
+  MZDR::LineDataWriter::WriteLinesToFile(_T("output.txt"), spLines, true);
+  MZDR::LineDataWriter::WriteLinesToFile<char>(_T("output.txt"), spLines, true, MZDR::LF);
+  MZDR::LineDataWriter::WriteLinesToShards(_T("output.txt"), spLines, MZDR::ShardByLineCount, 1000, true);
+
+  MZDR::DataIdentifier::GetContentFormat(_T("input.txt"));
+  MZDR::DataIdentifier::GetNewLineStyle(_T("input.txt"));
+
+  auto spText = spLines->GetLinesAsTextParallel<char>("\n", 1);
+}
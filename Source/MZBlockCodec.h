@@ -0,0 +1,197 @@
+#pragma once
+
+#include <vector>
+#include <stdint.h>
+#include <string.h>
+
+
+#include "MZDataReaderException.h"
+
+namespace MZDR
+{
+  //================================
+  // Fast LZ77 block codec (LZ4 style sequences). Used to compress blocks of line data in memory
+  //  Sequence : token (4 bit literal length, 4 bit match length - 4), literals, 16 bit offset
+  //  Length 15 in the token is continued with bytes of 255 + last byte. Last sequence only has literals
+  //================================
+
+  class BlockCodec
+  {
+  public:
+    static size_t MaxCompressedSize(size_t nSrc) { return nSrc + nSrc / 255 + 16; }
+
+    static void Compress(const BYTE* pSrc, size_t nSrc, std::vector<BYTE>& out)
+    {
+      out.clear();
+      out.reserve(MaxCompressedSize(nSrc));
+
+      size_t nAnchor = 0;
+      if (nSrc > MinInputSize)
+      {
+        std::vector<uint32_t> vTable(HashSize, static_cast<uint32_t>(NoPos));
+
+        const size_t nMatchLimit = nSrc - MatchStartMargin; // last match must start before this
+        const size_t nMatchEnd = nSrc - LastLiterals;        // and end before this
+        size_t nPos = 0;
+        size_t nMisses = 0;
+
+        while (nPos < nMatchLimit)
+        {
+          uint32_t value = Read32(pSrc + nPos);
+          uint32_t& ref = vTable[Hash(value)];
+          size_t nRef = ref;
+          ref = static_cast<uint32_t>(nPos);
+
+          if (nRef == NoPos || nPos - nRef > MaxOffset || Read32(pSrc + nRef) != value)
+          {
+            // Skip faster in data that do not compress
+            nPos += 1 + (nMisses++ >> 6);
+            continue;
+          }
+
+          nMisses = 0;
+          size_t nLen = MinMatch;
+          while (nPos + nLen < nMatchEnd && pSrc[nRef + nLen] == pSrc[nPos + nLen])
+            nLen++;
+
+          WriteSequence(out, pSrc + nAnchor, nPos - nAnchor, nPos - nRef, nLen);
+          nPos += nLen;
+          nAnchor = nPos;
+        }
+      }
+
+      WriteSequence(out, pSrc + nAnchor, nSrc - nAnchor, 0, 0);
+    }
+
+    // nDest MUST be the exact uncompressed size. Throws if the data is corrupt
+    static void Decompress(const BYTE* pSrc, size_t nSrc, BYTE* pDest, size_t nDest)
+    {
+      size_t nIn = 0;
+      size_t nOut = 0;
+
+      for (;;)
+      {
+        if (nIn >= nSrc)
+          ThrowCorrupt();
+
+        BYTE token = pSrc[nIn++];
+
+        size_t nLiterals = token >> 4;
+        if (nLiterals == 15)
+          nLiterals += ReadLength(pSrc, nSrc, nIn);
+
+        if (nLiterals > nSrc - nIn || nLiterals > nDest - nOut)
+          ThrowCorrupt();
+
+        CopyMemory(pDest + nOut, pSrc + nIn, nLiterals);
+        nIn += nLiterals;
+        nOut += nLiterals;
+
+        if (nIn == nSrc)
+          break; // Last sequence
+
+        if (nSrc - nIn < 2)
+          ThrowCorrupt();
+
+        size_t nOffset = pSrc[nIn] | (pSrc[nIn + 1] << 8);
+        nIn += 2;
+
+        size_t nLen = (token & 0x0F) + MinMatch;
+        if ((token & 0x0F) == 15)
+          nLen += ReadLength(pSrc, nSrc, nIn);
+
+        if (nOffset == 0 || nOffset > nOut || nLen > nDest - nOut)
+          ThrowCorrupt();
+
+        // Match can overlap the output. Copy byte by byte in that case
+        const BYTE* pMatch = pDest + nOut - nOffset;
+        if (nOffset >= nLen)
+        {
+          CopyMemory(pDest + nOut, pMatch, nLen);
+        }
+        else
+        {
+          for (size_t i = 0; i < nLen; i++)
+            pDest[nOut + i] = pMatch[i];
+        }
+        nOut += nLen;
+      }
+
+      if (nOut != nDest)
+        ThrowCorrupt();
+    }
+
+  protected:
+    static const size_t HashLog = 12;
+    static const size_t HashSize = 1 << HashLog;
+    static const uint32_t NoPos = 0xFFFFFFFF;
+    static const size_t MinMatch = 4;
+    static const size_t MaxOffset = 0xFFFF;
+    static const size_t LastLiterals = 5;
+    static const size_t MatchStartMargin = 12;
+    static const size_t MinInputSize = MatchStartMargin + 1;
+
+    static uint32_t Read32(const BYTE* p)
+    {
+      uint32_t value;
+      memcpy(&value, p, sizeof(value));
+      return value;
+    }
+
+    static size_t Hash(uint32_t value)
+    {
+      return (value * 2654435761u) >> (32 - HashLog);
+    }
+
+    static void WriteLength(std::vector<BYTE>& out, size_t nLen)
+    {
+      while (nLen >= 255)
+      {
+        out.push_back(255);
+        nLen -= 255;
+      }
+      out.push_back(static_cast<BYTE>(nLen));
+    }
+
+    // nMatchLen = 0 for the last sequence
+    static void WriteSequence(std::vector<BYTE>& out, const BYTE* pLiterals, size_t nLiterals, size_t nOffset, size_t nMatchLen)
+    {
+      size_t nMatchCode = nMatchLen ? nMatchLen - MinMatch : 0;
+
+      BYTE token = static_cast<BYTE>(((nLiterals < 15 ? nLiterals : 15) << 4) | (nMatchCode < 15 ? nMatchCode : 15));
+      out.push_back(token);
+      if (nLiterals >= 15)
+        WriteLength(out, nLiterals - 15);
+
+      out.insert(out.end(), pLiterals, pLiterals + nLiterals);
+
+      if (nMatchLen == 0)
+        return;
+
+      out.push_back(static_cast<BYTE>(nOffset));
+      out.push_back(static_cast<BYTE>(nOffset >> 8));
+      if (nMatchCode >= 15)
+        WriteLength(out, nMatchCode - 15);
+    }
+
+    static size_t ReadLength(const BYTE* pSrc, size_t nSrc, size_t& nIn)
+    {
+      size_t nLen = 0;
+      BYTE b;
+      do
+      {
+        if (nIn >= nSrc)
+          ThrowCorrupt();
+        b = pSrc[nIn++];
+        nLen += b;
+      } while (b == 255);
+      return nLen;
+    }
+
+    static void ThrowCorrupt()
+    {
+      throw MZDataReaderException(ERROR_INVALID_DATA, "Compressed block is corrupt");
+    }
+  };
+
+}
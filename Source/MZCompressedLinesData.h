@@ -0,0 +1,363 @@
+#pragma once
+
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <future>
+#include <algorithm>
+#include <atomic>
+
+#include "MZLinesData.h"
+#include "MZLineReader.h"
+#include "MZBlockCodec.h"
+#include "MZThreadPool.h"
+#include "MZMemoryBudget.h"
+
+namespace MZDR
+{
+  //================================
+  // Read only LinesData where the data buffers are compressed in memory.
+  //  Takes the buffers from a LinesData, or from LineReaderT while the data is read. Each buffer is a block that is compressed in the background by a thread pool.
+  //  Blocks are decompressed on demand when a line is accessed. Last used blocks are kept in a LRU cache.
+  //  Each line is stored as block + offset (16 bytes) instead of a pointer
+  // T MUST be char or wchar_t
+  //================================
+
+  template<class T, class TLinesData>
+  class CompressedLinesDataT
+  {
+  public:
+    typedef typename TLinesData::LineType Line;
+
+    // Line with a reference to the block data. The line is valid for as long as the LineRef exists
+    class LineRef
+    {
+    public:
+      LineRef(std::shared_ptr<const BYTE> spBlock, const Line& line)
+        : m_spBlock(std::move(spBlock))
+        , m_Line(line)
+      {
+      }
+
+      const Line& operator*() const { return m_Line; }
+      const Line* operator->() const { return &m_Line; }
+
+    protected:
+      std::shared_ptr<const BYTE> m_spBlock;
+      Line m_Line;
+    };
+
+    // Lines in source MUST point in to buffers allocated by source. source is empty after this.
+    //  nThreads = 0 will use one thread per core. nCacheBlocks is number of decompressed blocks to keep in memory
+    CompressedLinesDataT(TLinesData&& source, size_t nThreads = 0, size_t nCacheBlocks = 64)
+      : m_nCacheBlocks(nCacheBlocks > 0 ? nCacheBlocks : 1)
+    {
+      m_ContentFormat = source.ContentFormat();
+      m_spPool = std::make_unique<ThreadPool>(nThreads);
+      AddBuffers(source);
+    }
+
+    // Read lines from pReader. Each buffer is compressed as soon as all lines in it are parsed,
+    //  so the whole data is never in memory uncompressed. Reading waits if compression falls behind
+    CompressedLinesDataT(MZDR::DataReader* pReader, MZDR::LineParser* pLineParser, MZDR::ContentFormat format = MZDR::ContentUnknown, size_t nThreads = 0, size_t nCacheBlocks = 64)
+      : m_nCacheBlocks(nCacheBlocks > 0 ? nCacheBlocks : 1)
+    {
+      m_ContentFormat = format;
+      m_spPool = std::make_unique<ThreadPool>(nThreads);
+
+      LineReaderT<T, TLinesData> lineReader;
+      lineReader.SetSealedBufferCallback([this](TLinesData& sealed) { AddBuffers(sealed); });
+      lineReader.ReadLinesFromDataReader(pReader, pLineParser, format);
+    }
+
+    ~CompressedLinesDataT()
+    {
+      m_spPool.reset(); // Wait for the background compression
+    }
+
+    CompressedLinesDataT(const CompressedLinesDataT&) = delete;
+    CompressedLinesDataT& operator=(const CompressedLinesDataT&) = delete;
+
+    // Wait until all blocks are compressed. Exception from the compression is rethrown
+    void WaitForCompression()
+    {
+      for (auto&& future : m_vFutures)
+        future.get();
+      m_vFutures.clear();
+    }
+
+    MZDR::ContentFormat ContentFormat() const { return m_ContentFormat; }
+
+    size_t NumLines() const { return m_vItems.size(); }
+
+    LineRef GetLine(size_t nIdx) const
+    {
+      const LineEntry& entry = m_vItems.at(nIdx);
+      auto spBlock = GetBlockData(entry.nBlock);
+      Line line = MakeLine(spBlock.get(), entry);
+      return LineRef(std::move(spBlock), line);
+    }
+
+    // Call fn(const Line& line) for each line in order. Can be used with LineDataWriter::WriteLinesToDataWriter
+    template<class F>
+    void ForEachLine(F fn) const
+    {
+      std::shared_ptr<const BYTE> spBlock;
+      DWORD nBlock = 0;
+      for (auto&& entry : m_vItems)
+      {
+        if (spBlock == nullptr || entry.nBlock != nBlock)
+        {
+          nBlock = entry.nBlock;
+          spBlock = GetBlockData(nBlock);
+        }
+
+        fn(MakeLine(spBlock.get(), entry));
+      }
+    }
+
+    // Size of line data when all blocks are decompressed
+    size_t UncompressedSize() const { return m_nUncompressedSize; }
+
+    // Memory used by blocks, the line index and the decompressed cache. Also counted in MemoryBudget::Global()
+    MemoryUsageInfo MemoryUsage() const
+    {
+      MemoryUsageInfo info;
+      info.nBufferBytes = m_nStoredBytes;
+      info.nIndexBytes = m_vItems.size() * sizeof(LineEntry);
+      info.nIndexSlackBytes = (m_vItems.capacity() - m_vItems.size()) * sizeof(LineEntry);
+      info.nOtherBytes = m_nCacheBytes;
+      return info;
+    }
+
+    // Size of line data as stored. Blocks not compressed yet (or not compressible) are counted with the uncompressed size
+    size_t CompressedSize() const
+    {
+      size_t nTotal = 0;
+      for (auto&& spBlock : m_vBlocks)
+      {
+        std::lock_guard<std::mutex> lock(spBlock->mutex);
+        nTotal += spBlock->spRaw ? spBlock->nSize : spBlock->compressed.size();
+      }
+      return nTotal;
+    }
+
+  protected:
+    struct LineEntry
+    {
+      DWORD nBlock;
+      DWORD nOffset;
+      DWORD nLength;
+      BYTE newLine;
+      BYTE nBytesForNewLine;
+    };
+
+    struct Block
+    {
+      std::mutex mutex;
+      std::shared_ptr<const BYTE> spRaw; // Data until the block is compressed. Kept if the data do not compress
+      std::vector<BYTE> compressed;
+      DWORD nSize = 0;                   // Bytes used by lines. The end of the buffer may be unused
+      size_t nBufferSize = 0;            // Allocated size of spRaw
+    };
+
+    struct CacheEntry
+    {
+      std::shared_ptr<const BYTE> spData;
+      std::list<DWORD>::iterator itLru;
+    };
+
+    // Take the buffers and lines of source as new blocks and start to compress them
+    void AddBuffers(TLinesData& source)
+    {
+      const size_t nFirstBlock = m_vBlocks.size();
+      BuildIndex(source, nFirstBlock);
+
+      std::vector<std::unique_ptr<BYTE[]>> vBuffers;
+      std::vector<size_t> vBufferSizes;
+      source.DetachBuffers(vBuffers, vBufferSizes);
+
+      for (size_t i = 0; i < vBuffers.size(); i++)
+      {
+        Block& block = *m_vBlocks[nFirstBlock + i];
+        block.spRaw = std::shared_ptr<const BYTE>(vBuffers[i].release(), [](const BYTE* p) { delete[] p; });
+        block.nBufferSize = vBufferSizes[i];
+        m_nUncompressedSize += block.nSize;
+        m_nStoredBytes += block.nBufferSize;
+      }
+      m_nIndexBytes = m_vItems.capacity() * sizeof(LineEntry);
+      UpdateMemoryCharge();
+
+      // m_vBlocks can grow while blocks are compressed. Pass the block
+      for (size_t i = nFirstBlock; i < m_vBlocks.size(); i++)
+      {
+        Block* pBlock = m_vBlocks[i].get();
+        m_vFutures.push_back(m_spPool->Submit([this, pBlock] { CompressBlock(*pBlock); }));
+      }
+
+      // Limit the raw blocks waiting for compression. get() is called in WaitForCompression
+      while (m_vFutures.size() - m_nFuturesWaited > m_spPool->NumThreads() * 2)
+        m_vFutures[m_nFuturesWaited++].wait();
+    }
+
+    void BuildIndex(TLinesData& source, size_t nFirstBlock)
+    {
+      // Buffers sorted on address so the buffer of a line can be found with a binary search
+      std::vector<std::pair<const BYTE*, DWORD>> vSorted;
+      for (size_t i = 0; i < source.NumBuffers(); i++)
+      {
+        // Offsets in a block are 32 bit to keep the line entry small
+        if (source.GetBufferSize(i) > 0xFFFFFFFF)
+          throw MZDataReaderException(ERROR_ARITHMETIC_OVERFLOW, "Buffer is too large to compress");
+        if (nFirstBlock + i > 0xFFFFFFFF)
+          throw MZDataReaderException(ERROR_ARITHMETIC_OVERFLOW, "Too many blocks to compress");
+
+        vSorted.push_back(std::make_pair(source.GetBuffer(i), static_cast<DWORD>(i)));
+        m_vBlocks.push_back(std::make_unique<Block>());
+      }
+      std::sort(vSorted.begin(), vSorted.end());
+
+      if (m_vItems.empty())
+        m_vItems.reserve(source.NumLines());
+
+      DWORD nBlock = 0;
+      const BYTE* pBlockBegin = nullptr;
+      const BYTE* pBlockEnd = nullptr;
+      for (auto&& line : source.GetLines())
+      {
+        // Lines are mostly in the same buffer as the line before
+        if (line.pLine < pBlockBegin || line.pLine + line.lenght + line.nBytesForNewLine > pBlockEnd)
+        {
+          auto it = std::upper_bound(vSorted.begin(), vSorted.end(), std::make_pair(line.pLine, static_cast<DWORD>(0xFFFFFFFF)));
+          if (it == vSorted.begin())
+            throw MZDataReaderException(ERROR_INVALID_DATA, "Line data is not in a buffer owned by the LinesData");
+
+          --it;
+          nBlock = it->second;
+          pBlockBegin = it->first;
+          pBlockEnd = pBlockBegin + source.GetBufferSize(nBlock);
+          if (line.pLine + line.lenght + line.nBytesForNewLine > pBlockEnd)
+            throw MZDataReaderException(ERROR_INVALID_DATA, "Line data is not in a buffer owned by the LinesData");
+        }
+
+        LineEntry entry;
+        entry.nBlock = static_cast<DWORD>(nFirstBlock + nBlock);
+        entry.nOffset = static_cast<DWORD>(line.pLine - pBlockBegin);
+        entry.nLength = line.lenght;
+        entry.newLine = static_cast<BYTE>(LineHelper<T>::GetLineNewLine(line));
+        entry.nBytesForNewLine = line.nBytesForNewLine;
+        m_vItems.push_back(entry);
+
+        DWORD nEnd = entry.nOffset + entry.nLength + entry.nBytesForNewLine;
+        if (nEnd > m_vBlocks[entry.nBlock]->nSize)
+          m_vBlocks[entry.nBlock]->nSize = nEnd;
+      }
+    }
+
+    void CompressBlock(Block& block)
+    {
+      std::shared_ptr<const BYTE> spRaw;
+      {
+        std::lock_guard<std::mutex> lock(block.mutex);
+        spRaw = block.spRaw;
+      }
+
+      std::vector<BYTE> compressed;
+      BlockCodec::Compress(spRaw.get(), block.nSize, compressed);
+      if (compressed.size() >= block.nSize)
+        return; // Do not compress. Keep the raw data
+
+      compressed.shrink_to_fit();
+
+      // Lines returned before this keep the raw data alive
+      {
+        std::lock_guard<std::mutex> lock(block.mutex);
+        block.compressed.swap(compressed);
+        block.spRaw.reset();
+      }
+
+      m_nStoredBytes += block.compressed.capacity();
+      m_nStoredBytes -= block.nBufferSize;
+      UpdateMemoryCharge();
+    }
+
+    std::shared_ptr<const BYTE> GetBlockData(DWORD nBlock) const
+    {
+      Block& block = *m_vBlocks[nBlock];
+      {
+        std::lock_guard<std::mutex> lock(block.mutex);
+        if (block.spRaw)
+          return block.spRaw;
+      }
+
+      {
+        std::lock_guard<std::mutex> lock(m_CacheMutex);
+        auto it = m_Cache.find(nBlock);
+        if (it != m_Cache.end())
+        {
+          m_LruList.splice(m_LruList.begin(), m_LruList, it->second.itLru);
+          return it->second.spData;
+        }
+      }
+
+      // compressed do not change after spRaw is released. Decompress without holding a lock
+      std::shared_ptr<BYTE> spData(new BYTE[block.nSize], [](BYTE* p) { delete[] p; });
+      BlockCodec::Decompress(block.compressed.data(), block.compressed.size(), spData.get(), block.nSize);
+
+      std::lock_guard<std::mutex> lock(m_CacheMutex);
+      auto it = m_Cache.find(nBlock);
+      if (it != m_Cache.end())
+        return it->second.spData; // Decompressed by another thread at the same time
+
+      m_LruList.push_front(nBlock);
+      m_Cache[nBlock] = CacheEntry{ spData, m_LruList.begin() };
+      m_nCacheBytes += block.nSize;
+
+      if (m_LruList.size() > m_nCacheBlocks)
+      {
+        m_nCacheBytes -= m_vBlocks[m_LruList.back()]->nSize;
+        m_Cache.erase(m_LruList.back());
+        m_LruList.pop_back();
+      }
+
+      UpdateMemoryCharge();
+      return spData;
+    }
+
+    // Called from the compression threads and readers. Cached blocks still used by a LineRef after they are removed are not counted
+    void UpdateMemoryCharge() const
+    {
+      std::lock_guard<std::mutex> lock(m_ChargeMutex);
+      m_MemoryCharge.Set(m_nIndexBytes + m_nStoredBytes + m_nCacheBytes);
+    }
+
+    static Line MakeLine(const BYTE* pBlock, const LineEntry& entry)
+    {
+      return Line(pBlock + entry.nOffset, entry.nLength, static_cast<NewLine>(entry.newLine), entry.nBytesForNewLine);
+    }
+
+    std::vector<LineEntry> m_vItems;
+    std::vector<std::unique_ptr<Block>> m_vBlocks;
+    size_t m_nUncompressedSize = 0;
+    MZDR::ContentFormat m_ContentFormat = MZDR::ContentUnknown;
+
+    size_t m_nCacheBlocks;
+    mutable std::mutex m_CacheMutex;
+    mutable std::list<DWORD> m_LruList;
+    mutable std::unordered_map<DWORD, CacheEntry> m_Cache;
+
+    // Memory counted in the budget. Updated by the compression threads, so m_vItems is not used
+    std::atomic<size_t> m_nIndexBytes{ 0 };
+    std::atomic<size_t> m_nStoredBytes{ 0 };        // Raw buffers not compressed yet and compressed blocks
+    mutable std::atomic<size_t> m_nCacheBytes{ 0 };
+    mutable std::mutex m_ChargeMutex;
+    mutable MemoryCharge m_MemoryCharge;
+
+    std::vector<std::future<void>> m_vFutures;
+    size_t m_nFuturesWaited = 0;
+    std::unique_ptr<ThreadPool> m_spPool; // Last. Destroyed first
+  };
+
+}
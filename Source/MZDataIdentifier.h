@@ -1,9 +1,14 @@
 #pragma once
 
-#include <WinBase.h>
 #include <memory>
+#include "MZPlatform.h"
 #include "MZDataReaderException.h"
-#include "../../MZMisc/Source/AutoHandle.h"
+#include "MZFileIO.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 namespace MZDR
 {
@@ -16,33 +21,93 @@ namespace MZDR
     ContentBinary,
   };
 
+  enum NewLine
+  {
+    NoNewLine = 0,
+    CR, // \r
+    LF, // \n
+    CRLF,
+    Unknown,
+  };
+
   class DataIdentifier
   {
   public:
     static ContentFormat GetContentFormat(const STLString& filename)
     {
-      const DWORD dataLen = 1024;
-      DWORD len = 0;
+      const size_t dataLen = 1024;
+      size_t len = 0;
       auto pData = GetSampleData(filename, dataLen, &len);
 
-      if (HasUnicodeFileHeader(pData.get(), len) || IsUnicodeFile(pData.get(), len))
+      return GetContentFormat(pData.get(), len);
+    }
+
+    // Identify sample data. (Use when data is not read with GetSampleData. Like from a PosixFileDataReader)
+    static ContentFormat GetContentFormat(const BYTE* pData, size_t len)
+    {
+      if (HasUnicodeFileHeader(pData, len) || IsUnicodeFile(pData, len))
         return ContentUnicode;
 
-      if (HasUTF8FileHeader(pData.get(), len))
+      if (HasUTF8FileHeader(pData, len))
         return ContentUTF8; // UTF8 not supported. But as lines goes. it is ascii compatible.. (sorting might be wrong)
 
-      if (IsBinary(pData.get(), len))
+      if (IsBinary(pData, len))
         return ContentBinary;
 
       return ContentAscii;
     }
 
+    // Find newline style from the first newline in the file. Use it to select the newline policy for LineParser
+    static NewLine GetNewLineStyle(const STLString& filename)
+    {
+      const size_t dataLen = 4096;
+      size_t len = 0;
+      auto pData = GetSampleData(filename, dataLen, &len);
+
+      ContentFormat format = ContentAscii;
+      if (HasUnicodeFileHeader(pData.get(), len) || IsUnicodeFile(pData.get(), len))
+        format = ContentUnicode;
+
+      return GetNewLineStyle(pData.get(), len, format);
+    }
+
+    // Returns Unknown if no newline was found in the data
+    static NewLine GetNewLineStyle(const BYTE* pData, size_t nLen, ContentFormat format)
+    {
+      // Unicode is UTF-16LE. Check low byte and require the high byte to be zero
+      const size_t nCharSize = (format == ContentUnicode) ? 2 : 1;
+
+      for (size_t i = 0; i + nCharSize <= nLen; i += nCharSize)
+      {
+        if (nCharSize == 2 && pData[i + 1] != 0)
+          continue;
+
+        if (pData[i] == 0x0a)
+          return LF;
+
+        if (pData[i] == 0x0d)
+        {
+          size_t nNext = i + nCharSize;
+          if (nNext + nCharSize > nLen)
+            return Unknown; // can't tell if it is CR or CRLF
+
+          if (pData[nNext] == 0x0a && (nCharSize == 1 || pData[nNext + 1] == 0))
+            return CRLF;
+
+          return CR;
+        }
+      }
+
+      return Unknown;
+    }
+
 
-    static  std::unique_ptr<BYTE []> GetSampleData(const STLString& filename, DWORD sampleSize, DWORD* pDataRead = nullptr)
+    static  std::unique_ptr<BYTE []> GetSampleData(const STLString& filename, size_t sampleSize, size_t* pDataRead = nullptr)
     {
       if (::GetFileAttributes(filename.c_str()) == INVALID_FILE_ATTRIBUTES)
         throw MZDR::MZDataReaderException(ERROR_FILE_NOT_FOUND, "File not found");
 
+#ifdef _WIN32
       AutoHandle hFile(::CreateFile(filename.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, 0));
       if (hFile.isValid() == false)
       {
@@ -51,8 +116,27 @@ namespace MZDR
 
       auto pBuffer = std::make_unique<BYTE []>(sampleSize);
       DWORD dwBytesRead = 0;
-      if (::ReadFile(hFile, pBuffer.get(), sampleSize, &dwBytesRead, nullptr) == FALSE)
+      DWORD dwToRead = (sampleSize > MaxIoChunkSize) ? MaxIoChunkSize : static_cast<DWORD>(sampleSize);
+      if (::ReadFile(hFile, pBuffer.get(), dwToRead, &dwBytesRead, nullptr) == FALSE)
         throw MZDR::MZDataReaderException(::GetLastError(), "Unable to read file content");
+#else
+      int fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+      if (fd < 0)
+        throw MZDR::MZDataReaderException(errno, "Unable to open file");
+
+      auto pBuffer = std::make_unique<BYTE []>(sampleSize);
+      ssize_t nRead = 0;
+      do
+      {
+        nRead = ::read(fd, pBuffer.get(), sampleSize);
+      } while (nRead < 0 && errno == EINTR);
+
+      int err = errno;
+      ::close(fd);
+      if (nRead < 0)
+        throw MZDR::MZDataReaderException(err, "Unable to read file content");
+      size_t dwBytesRead = static_cast<size_t>(nRead);
+#endif
 
       if (pDataRead)
         *pDataRead = dwBytesRead;
@@ -61,7 +145,7 @@ namespace MZDR
     }
 
 
-    static bool HasUnicodeFileHeader(const BYTE* pData, DWORD nLen)
+    static bool HasUnicodeFileHeader(const BYTE* pData, size_t nLen)
     {
       if (nLen < 2)
         return false;
@@ -72,7 +156,7 @@ namespace MZDR
       return false;
     }
 
-    static  bool HasUTF8FileHeader(const BYTE* pData, DWORD nLen)
+    static  bool HasUTF8FileHeader(const BYTE* pData, size_t nLen)
     {
       if (nLen < 3)
         return false;
@@ -86,7 +170,7 @@ namespace MZDR
       return false;
     }
 
-    static  bool HasXMLUTF8Header(const BYTE* pData, DWORD nLen)
+    static  bool HasXMLUTF8Header(const BYTE* pData, size_t nLen)
     {
       if (nLen < 6)
         return false;
@@ -120,7 +204,7 @@ namespace MZDR
       return false;
     }
 
-    static bool IsUnicodeFile(const BYTE* pData, DWORD nLen)
+    static bool IsUnicodeFile(const BYTE* pData, size_t nLen)
     {
       if (nLen < 10)
         return false;
@@ -152,12 +236,12 @@ namespace MZDR
       return false;
     }
 
-    static bool IsBinary(const BYTE* pData, DWORD nMaxLen)
+    static bool IsBinary(const BYTE* pData, size_t nMaxLen)
     {
-      DWORD nCount_ValidTextCharacters = 0;  // 
-      DWORD nCount_NotValidTextCharacters = 0;
+      size_t nCount_ValidTextCharacters = 0;  // 
+      size_t nCount_NotValidTextCharacters = 0;
       CHAR* pStart = (CHAR*) pData;
-      for (DWORD i = 0; i < nMaxLen; i++, pStart++)
+      for (size_t i = 0; i < nMaxLen; i++, pStart++)
       {
         if (IsValidTextCharacter((UCHAR) (*pStart)))
           nCount_ValidTextCharacters++;
@@ -168,7 +252,7 @@ namespace MZDR
 
       }
       // if more the 20% is NoneAscii then its binary
-      return (nCount_NotValidTextCharacters > (DWORD) (nMaxLen * 0.20) ? true : false);
+      return (nCount_NotValidTextCharacters > (size_t) (nMaxLen * 0.20) ? true : false);
     }
 
   };
@@ -1,48 +1,42 @@
 #pragma once
 
-#include "../../MZMisc/Source/AutoHandle.h"
-
-#include "MZDataReader.h"
+#include "MZPlatform.h"
 #include "MZDataReaderException.h"
-
-#ifndef STL_string
-#define STL_string std::string
-#ifndef _UNICODE
-typedef STL_string	 STLString;
-#endif
-#endif
-
-#ifndef STL_wstring
-#define STL_wstring std::wstring
-#ifdef _UNICODE
-typedef STL_wstring  STLString;
-#endif
-#endif
+#include "MZDataIdentifier.h"
+#include "MZFileIO.h"
 
 namespace MZDR
 {
   //================================
   // Data reader base class
-  //
+  //  Sizes and offsets are 64 bit. Readers split large reads in to chunks of MaxIoChunkSize for each system call
   //================================
   
   class DataReader
   {
   public:
     size_t TotalDataSize() { return m_nTotalDataSize; }
-    virtual void ReadDataThrow(BYTE* pBuffer, DWORD dwBytesToRead, DWORD* dwBytesRead) = 0;
+    virtual void ReadDataThrow(BYTE* pBuffer, size_t nBytesToRead, size_t* pBytesRead) = 0;
+
+    // Read at nOffset. Do not change the position used by ReadDataThrow. Not supported by all readers
+    virtual void ReadDataAtThrow(size_t /*nOffset*/, BYTE* /*pBuffer*/, size_t /*nBytesToRead*/, size_t* /*pBytesRead*/)
+    {
+      throw MZDR::MZDataReaderException(ERROR_NOT_SUPPORTED, "Read at offset is not supported by this reader");
+    }
+
     virtual void Close() {}
   protected:
     size_t m_nTotalDataSize = 0;
 
   };
 
+#ifdef _WIN32
   class FileDataReader : public DataReader
   {
   public:
     FileDataReader(const STLString& filename)
     {
-      m_hFile = AutoHandle(::CreateFile(filename.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, 0));
+      m_hFile = AutoHandle(::CreateFile(filename.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, 0));
       if (m_hFile.isValid() == false)
       {
         USES_CONVERSION;
@@ -65,14 +59,65 @@ namespace MZDR
       m_nTotalDataSize = static_cast<size_t>(fileSize.QuadPart);
     }
     
-    void ReadDataThrow(BYTE* pBuffer, DWORD dwBytesToRead, DWORD* dwBytesRead) override
+    // ReadFile takes a DWORD size. Large reads are done in chunks
+    void ReadDataThrow(BYTE* pBuffer, size_t nBytesToRead, size_t* pBytesRead) override
+    {
+      *pBytesRead = 0;
+      while (nBytesToRead > 0)
+      {
+        DWORD dwChunk = (nBytesToRead > MaxIoChunkSize) ? MaxIoChunkSize : static_cast<DWORD>(nBytesToRead);
+        DWORD dwBytesRead = 0;
+        if (ReadFile(m_hFile, pBuffer, dwChunk, &dwBytesRead, nullptr) == FALSE)
+        {
+          throw MZDR::MZDataReaderException(::GetLastError(), "Failed to read file");
+        }
+
+        *pBytesRead += dwBytesRead;
+        if (dwBytesRead < dwChunk)
+          break; // End of file
+
+        pBuffer += dwBytesRead;
+        nBytesToRead -= dwBytesRead;
+      }
+    }
+
+    void ReadDataAtThrow(size_t nOffset, BYTE* pBuffer, size_t nBytesToRead, size_t* pBytesRead) override
     {
-      if (ReadFile(m_hFile, pBuffer, dwBytesToRead, dwBytesRead, nullptr) == FALSE)
+      // ReadFile with OVERLAPPED moves the file pointer of a synchronous handle. Restore it after the read
+      LARGE_INTEGER zero = { 0 };
+      LARGE_INTEGER curPos = { 0 };
+      if (::SetFilePointerEx(m_hFile, zero, &curPos, FILE_CURRENT) == FALSE)
+        throw MZDR::MZDataReaderException(::GetLastError(), "Failed to get file position");
+
+      *pBytesRead = 0;
+      BOOL bResult = TRUE;
+      DWORD dwError = 0;
+      while (nBytesToRead > 0)
       {
-        throw MZDR::MZDataReaderException(::GetLastError(), "Failed to read file");
+        OVERLAPPED overlapped = { 0 };
+        overlapped.Offset = static_cast<DWORD>(static_cast<ULONGLONG>(nOffset));
+        overlapped.OffsetHigh = static_cast<DWORD>(static_cast<ULONGLONG>(nOffset) >> 32);
+
+        DWORD dwChunk = (nBytesToRead > MaxIoChunkSize) ? MaxIoChunkSize : static_cast<DWORD>(nBytesToRead);
+        DWORD dwBytesRead = 0;
+        bResult = ReadFile(m_hFile, pBuffer, dwChunk, &dwBytesRead, &overlapped);
+        dwError = ::GetLastError();
+        if (bResult == FALSE)
+          break;
+
+        *pBytesRead += dwBytesRead;
+        if (dwBytesRead < dwChunk)
+          break;
+
+        pBuffer += dwBytesRead;
+        nOffset += dwBytesRead;
+        nBytesToRead -= dwBytesRead;
       }
 
-      //  assert(*dwBytesRead == dwBytesToRead);
+      ::SetFilePointerEx(m_hFile, curPos, nullptr, FILE_BEGIN);
+
+      if (bResult == FALSE && dwError != ERROR_HANDLE_EOF)
+        throw MZDR::MZDataReaderException(dwError, "Failed to read file");
     }
     void Close() override
     {
@@ -82,6 +127,159 @@ namespace MZDR
   protected:
     AutoHandle m_hFile;
   };
+#else
+  //================================
+  // Read file using open/pread. Hints the kernel that the file is read sequentially
+  //================================
+
+  class PosixFileDataReader : public DataReader
+  {
+  public:
+    PosixFileDataReader(const std::string& filename, DWORD dwFileFlags = PosixFileDefault)
+      : m_dwFlags(dwFileFlags)
+    {
+      m_fd = PosixFile::Open(filename, O_RDONLY, m_dwFlags);
+      if (m_fd < 0)
+      {
+        std::string str = "Unable to open file : ";
+        str += filename;
+        throw MZDR::MZDataReaderException(errno, str.c_str());
+      }
+
+      struct stat st;
+      if (::fstat(m_fd, &st) != 0)
+      {
+        int err = errno;
+        Close();
+
+        std::string str = "Failed to get filesize : ";
+        str += filename;
+        throw MZDR::MZDataReaderException(err, str.c_str());
+      }
+
+      m_nTotalDataSize = static_cast<size_t>(st.st_size);
+
+      ::posix_fadvise(m_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+      if (m_dwFlags & PosixFileDirectIO)
+        m_spDirectBuffer = PosixFile::AllocateAligned(PosixFile::DirectIOBufferSize);
+    }
+
+    ~PosixFileDataReader()
+    {
+      Close();
+    }
+
+    void ReadDataThrow(BYTE* pBuffer, size_t nBytesToRead, size_t* pBytesRead) override
+    {
+      if (m_dwFlags & PosixFileDirectIO)
+        *pBytesRead = ReadDirect(pBuffer, nBytesToRead);
+      else
+        *pBytesRead = PosixFile::ReadThrow(m_fd, pBuffer, nBytesToRead, m_nPos);
+
+      if ((m_dwFlags & PosixFileDropCache) && *pBytesRead > 0)
+        ::posix_fadvise(m_fd, m_nPos, *pBytesRead, POSIX_FADV_DONTNEED);
+
+      m_nPos += *pBytesRead;
+    }
+
+    void ReadDataAtThrow(size_t nOffset, BYTE* pBuffer, size_t nBytesToRead, size_t* pBytesRead) override
+    {
+      if (m_dwFlags & PosixFileDirectIO)
+        *pBytesRead = ReadDirectAt(nOffset, pBuffer, nBytesToRead);
+      else
+        *pBytesRead = PosixFile::ReadThrow(m_fd, pBuffer, nBytesToRead, static_cast<off_t>(nOffset));
+    }
+
+    void Close() override
+    {
+      if (m_fd >= 0)
+      {
+        ::close(m_fd);
+        m_fd = -1;
+      }
+    }
+
+  protected:
+    // O_DIRECT need aligned offset, size and buffer. Read aligned blocks in to m_spDirectBuffer and copy from there
+    size_t ReadDirect(BYTE* pBuffer, size_t nBytesToRead)
+    {
+      size_t nTotal = 0;
+      while (nTotal < nBytesToRead)
+      {
+        if (m_nDirectPos >= m_nDirectLen)
+        {
+          off_t blockOffset = static_cast<off_t>(m_nPos + nTotal);
+          m_nDirectLen = PosixFile::ReadThrow(m_fd, m_spDirectBuffer.get(), PosixFile::DirectIOBufferSize, blockOffset);
+          m_nDirectPos = 0;
+          if (m_nDirectLen == 0)
+            break;
+        }
+
+        size_t nCopy = m_nDirectLen - m_nDirectPos;
+        if (nCopy > nBytesToRead - nTotal)
+          nCopy = nBytesToRead - nTotal;
+
+        CopyMemory(pBuffer + nTotal, m_spDirectBuffer.get() + m_nDirectPos, nCopy);
+        m_nDirectPos += nCopy;
+        nTotal += nCopy;
+      }
+      return nTotal;
+    }
+
+    // Same as ReadDirect. But with its own buffer so the sequential read is not changed
+    size_t ReadDirectAt(size_t nOffset, BYTE* pBuffer, size_t nBytesToRead)
+    {
+      if (m_spDirectAtBuffer == nullptr)
+        m_spDirectAtBuffer = PosixFile::AllocateAligned(PosixFile::DirectIOBufferSize);
+
+      size_t nTotal = 0;
+      while (nTotal < nBytesToRead)
+      {
+        size_t nPos = nOffset + nTotal;
+        size_t nBlockOffset = nPos & ~(PosixFile::DirectIOAlignment - 1);
+
+        // Only read the aligned blocks that are needed
+        size_t nBlockEnd = (nOffset + nBytesToRead + PosixFile::DirectIOAlignment - 1) & ~(PosixFile::DirectIOAlignment - 1);
+        size_t nBlockSize = nBlockEnd - nBlockOffset;
+        if (nBlockSize > PosixFile::DirectIOBufferSize)
+          nBlockSize = PosixFile::DirectIOBufferSize;
+
+        size_t nRead = PosixFile::ReadThrow(m_fd, m_spDirectAtBuffer.get(), nBlockSize, static_cast<off_t>(nBlockOffset));
+        if (nRead <= nPos - nBlockOffset)
+          break;
+
+        size_t nCopy = nRead - (nPos - nBlockOffset);
+        if (nCopy > nBytesToRead - nTotal)
+          nCopy = nBytesToRead - nTotal;
+
+        CopyMemory(pBuffer + nTotal, m_spDirectAtBuffer.get() + (nPos - nBlockOffset), nCopy);
+        nTotal += nCopy;
+      }
+      return nTotal;
+    }
+
+    int m_fd = -1;
+    DWORD m_dwFlags;
+    size_t m_nPos = 0;
+
+    PosixFile::AlignedBuffer m_spDirectBuffer;
+    size_t m_nDirectPos = 0;
+    size_t m_nDirectLen = 0;
+
+    PosixFile::AlignedBuffer m_spDirectAtBuffer;
+  };
+
+  // Same API as on Windows. Implemented by PosixFileDataReader
+  class FileDataReader : public PosixFileDataReader
+  {
+  public:
+    FileDataReader(const STLString& filename)
+      : PosixFileDataReader(filename)
+    {
+    }
+  };
+#endif // _WIN32
  
   // ============================================================================
 
@@ -105,24 +303,36 @@ namespace MZDR
       }
     }
 
-    void ReadDataThrow(BYTE* pBuffer, DWORD dwBytesToRead, DWORD* dwBytesRead) override
+    void ReadDataThrow(BYTE* pBuffer, size_t nBytesToRead, size_t* pBytesRead) override
     {
-      DWORD dwBytesToCopy = 0;
-      if (m_nCurPos + dwBytesToRead > m_nTotalDataSize)
-        dwBytesToCopy = static_cast<DWORD>(m_nTotalDataSize) - m_nCurPos;
+      size_t nBytesToCopy = 0;
+      if (nBytesToRead > m_nTotalDataSize - m_nCurPos)
+        nBytesToCopy = m_nTotalDataSize - m_nCurPos;
       else
-        dwBytesToCopy = dwBytesToRead;
+        nBytesToCopy = nBytesToRead;
+
+      if (nBytesToCopy)
+        CopyMemory(pBuffer, m_pData + m_nCurPos, nBytesToCopy);
 
-      CopyMemory(pBuffer, m_pData + m_nCurPos, dwBytesToCopy);
+      m_nCurPos += nBytesToCopy;
+      *pBytesRead = nBytesToCopy;
+    }
+
+    void ReadDataAtThrow(size_t nOffset, BYTE* pBuffer, size_t nBytesToRead, size_t* pBytesRead) override
+    {
+      size_t nBytesToCopy = 0;
+      if (nOffset < m_nTotalDataSize)
+        nBytesToCopy = (nBytesToRead < m_nTotalDataSize - nOffset) ? nBytesToRead : m_nTotalDataSize - nOffset;
 
-      m_nCurPos += dwBytesToCopy;
-      *dwBytesRead = dwBytesToCopy;
+      if (nBytesToCopy)
+        CopyMemory(pBuffer, m_pData + nOffset, nBytesToCopy);
+      *pBytesRead = nBytesToCopy;
     }
 
   protected:
     bool m_bFreeMemory = false;
     const BYTE* m_pData = nullptr;
-    DWORD m_nCurPos = 0;
+    size_t m_nCurPos = 0;
   };
 
 }
\ No newline at end of file
@@ -1,11 +1,15 @@
 #pragma once
 
+#include <stdexcept>
+
+#include "MZPlatform.h"
+
 namespace MZDR
 {
-  struct MZDataReaderException : std::exception
+  struct MZDataReaderException : std::runtime_error
   {
     MZDataReaderException(DWORD dwError, const char* szText)
-      : std::exception(szText)
+      : std::runtime_error(szText)
     {
       errorCode = dwError;
     }
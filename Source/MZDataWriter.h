@@ -1,9 +1,16 @@
 
 #pragma once
 
-#include "../../MZMisc/Source/AutoHandle.h"
+#include <functional>
+#include <mutex>
+
+#include "MZPlatform.h"
 #include "MZDataReaderException.h"
+#include "MZDataIdentifier.h"
+#include "MZFileIO.h"
 #include "MZLinesData.h"
+#include "MZNewLineConverter.h"
+#include "MZThreadPool.h"
 
 namespace MZDR
 {
@@ -13,12 +20,18 @@ namespace MZDR
     DWORD nEnd;
   };
 
+  enum ShardMode
+  {
+    ShardByLineCount = 0,   // Max number of lines in each shard
+    ShardBySize,            // Max number of bytes in each shard. Lines are not split. A line larger then the max get its own shard
+  };
+
 
   // move ot MCStringutils.h
   class MCExtra
   {
   public:
-    static std::wstring Format(const TCHAR* strFormat, ...)
+    static STLString Format(const TCHAR* strFormat, ...)
     {
       TCHAR str[2048];
       str[0] = '\0';
@@ -73,6 +86,24 @@ namespace MZDR
       return false;
     }
 
+    // filename_0001.ext for nShard 1. If bUnique, _(0002) is added (like GetUniqueFilename) until the name is not used
+    static STLString GetShardFilename(const STLString& filename, size_t nShard, bool bUnique)
+    {
+      size_t nDot = filename.find_last_of(_T('.'));
+      size_t nSlash = filename.find_last_of(_T("\\/"));
+      if (nDot == STLString::npos || (nSlash != STLString::npos && nDot < nSlash))
+        nDot = filename.length();
+
+      STLString strRoot = filename.substr(0, nDot) + Format(_T("_%04d"), static_cast<int>(nShard));
+      STLString strExt = filename.substr(nDot);
+
+      STLString strPath = strRoot + strExt;
+      for (int i = 2; bUnique && i <= 9999 && GetFileAttributes(strPath.c_str()) != INVALID_FILE_ATTRIBUTES; i++)
+        strPath = strRoot + Format(_T("_(%04d)"), i) + strExt;
+
+      return strPath;
+    }
+
     static bool BackupFileEx(const TCHAR* filename, TCHAR* szNewName, DWORD len)
     {
       STLString strPath = filename;
@@ -104,32 +135,33 @@ namespace MZDR
       m_lenNewLineData = lenData;
     }
 
-    virtual DWORD WriteNewLine()
+    virtual size_t WriteNewLine()
     {
-      DWORD dwBytesWritten = 0;
+      size_t nBytesWritten = 0;
       if (m_lenNewLineData > 0)
       {
-        WriteData(m_pNewLineData.get(), m_lenNewLineData, &dwBytesWritten);
+        WriteData(m_pNewLineData.get(), m_lenNewLineData, &nBytesWritten);
       }
-      return dwBytesWritten;
+      return nBytesWritten;
     }
 
-    virtual DWORD WriteData(const BYTE* pData, DWORD lenData)
+    virtual size_t WriteData(const BYTE* pData, size_t lenData)
     {
-      DWORD dwBytesWritten = 0;
+      size_t nBytesWritten = 0;
       if (lenData > 0)
       {
-        WriteData(pData, lenData, &dwBytesWritten);
+        WriteData(pData, lenData, &nBytesWritten);
       }
-      return dwBytesWritten;
+      return nBytesWritten;
     }
   protected:
     std::unique_ptr<BYTE []> m_pNewLineData;
     DWORD m_lenNewLineData = 0;
 
-    virtual void WriteData(const BYTE* pBuffer, DWORD dwBytesToWrite, DWORD* dwBytesWritten) = 0;
+    virtual void WriteData(const BYTE* pBuffer, size_t nBytesToWrite, size_t* pBytesWritten) = 0;
   };
 
+#ifdef _WIN32
   class FileDataWriter : public DataWriter
   {
   public:
@@ -156,15 +188,181 @@ namespace MZDR
     
   protected:
     AutoHandle m_hFile;
-    void WriteData(const BYTE* pBuffer, DWORD dwBytesToWrite, DWORD* dwBytesWritten)
+    void WriteData(const BYTE* pBuffer, size_t nBytesToWrite, size_t* pBytesWritten)
     {
-      if (WriteFile(m_hFile, pBuffer, dwBytesToWrite, dwBytesWritten, nullptr) == FALSE)
+      size_t nTotal = 0;
+      while (nBytesToWrite > 0)
       {
-        throw MZDataReaderException(::GetLastError(), "Failed to write data to file");
+        DWORD dwChunk = (nBytesToWrite > MaxIoChunkSize) ? MaxIoChunkSize : static_cast<DWORD>(nBytesToWrite);
+        DWORD dwBytesWritten = 0;
+        if (WriteFile(m_hFile, pBuffer, dwChunk, &dwBytesWritten, nullptr) == FALSE)
+        {
+          throw MZDataReaderException(::GetLastError(), "Failed to write data to file");
+        }
+
+        nTotal += dwBytesWritten;
+        pBuffer += dwBytesWritten;
+        nBytesToWrite -= dwBytesWritten;
       }
+
+      if (pBytesWritten)
+        *pBytesWritten = nTotal;
     }
   };
 
+#else
+  //================================
+  // Write file using open/pwrite. Prepare() reserve disk space with fallocate
+  //================================
+
+  class PosixFileDataWriter : public DataWriter
+  {
+  public:
+    PosixFileDataWriter()
+    {
+    }
+
+    ~PosixFileDataWriter()
+    {
+      try
+      {
+        Close();
+      }
+      catch (...)
+      {
+      }
+    }
+
+    void OpenForWriting(const std::string& filename, bool bOverwrite, DWORD dwFileFlags = PosixFileDefault)
+    {
+      m_dwFlags = dwFileFlags;
+      int openFlags = O_WRONLY | O_CREAT | (bOverwrite ? O_TRUNC : O_EXCL);
+
+      m_fd = PosixFile::Open(filename, openFlags, m_dwFlags);
+      if (m_fd < 0)
+      {
+        std::string str = "Unable to open file for writing : ";
+        str += filename;
+        throw MZDataReaderException(errno, str.c_str());
+      }
+
+      m_nPos = 0;
+      m_nDirectLen = 0;
+      if (m_dwFlags & PosixFileDirectIO)
+        m_spDirectBuffer = PosixFile::AllocateAligned(PosixFile::DirectIOBufferSize);
+    }
+
+    // Reserve space on disk without changing the file size
+    void Prepare(size_t dwExpectedDataSize) override
+    {
+      if (m_fd < 0 || dwExpectedDataSize == 0)
+        return;
+
+#ifdef __linux__
+      // Filesystem without fallocate support is not an error. The space is allocated when it is written
+      if (::fallocate(m_fd, FALLOC_FL_KEEP_SIZE, 0, static_cast<off_t>(dwExpectedDataSize)) != 0 && errno != EOPNOTSUPP)
+        throw MZDataReaderException(errno, "Failed to reserve disk space");
+#endif
+    }
+
+    void Close() override
+    {
+      if (m_fd < 0)
+        return;
+
+      int fd = m_fd;
+      m_fd = -1;
+
+      try
+      {
+        FlushDirect(fd);
+      }
+      catch (...)
+      {
+        ::close(fd);
+        throw;
+      }
+
+      ::close(fd);
+    }
+
+  protected:
+    void WriteData(const BYTE* pBuffer, size_t nBytesToWrite, size_t* pBytesWritten) override
+    {
+      if (m_dwFlags & PosixFileDirectIO)
+      {
+        WriteDirect(pBuffer, nBytesToWrite);
+      }
+      else
+      {
+        PosixFile::WriteThrow(m_fd, pBuffer, nBytesToWrite, m_nPos);
+        if (m_dwFlags & PosixFileDropCache)
+        {
+#ifdef __linux__
+          // Pages must be written before they can be dropped
+          ::sync_file_range(m_fd, m_nPos, nBytesToWrite, SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+#endif
+          ::posix_fadvise(m_fd, m_nPos, nBytesToWrite, POSIX_FADV_DONTNEED);
+        }
+        m_nPos += nBytesToWrite;
+      }
+
+      if (pBytesWritten)
+        *pBytesWritten = nBytesToWrite;
+    }
+
+    // Collect data in the aligned buffer and write when it is full
+    void WriteDirect(const BYTE* pBuffer, size_t nBytes)
+    {
+      while (nBytes > 0)
+      {
+        size_t nCopy = PosixFile::DirectIOBufferSize - m_nDirectLen;
+        if (nCopy > nBytes)
+          nCopy = nBytes;
+
+        CopyMemory(m_spDirectBuffer.get() + m_nDirectLen, pBuffer, nCopy);
+        m_nDirectLen += nCopy;
+        pBuffer += nCopy;
+        nBytes -= nCopy;
+
+        if (m_nDirectLen == PosixFile::DirectIOBufferSize)
+        {
+          PosixFile::WriteThrow(m_fd, m_spDirectBuffer.get(), m_nDirectLen, m_nPos);
+          m_nPos += m_nDirectLen;
+          m_nDirectLen = 0;
+        }
+      }
+    }
+
+    // Last block is not a multiple of the alignment. Turn off O_DIRECT and write it
+    void FlushDirect(int fd)
+    {
+      if ((m_dwFlags & PosixFileDirectIO) == 0 || m_nDirectLen == 0)
+        return;
+
+#ifdef O_DIRECT
+      int flags = ::fcntl(fd, F_GETFL);
+      ::fcntl(fd, F_SETFL, flags & ~O_DIRECT);
+#endif
+      PosixFile::WriteThrow(fd, m_spDirectBuffer.get(), m_nDirectLen, m_nPos);
+      m_nPos += m_nDirectLen;
+      m_nDirectLen = 0;
+    }
+
+    int m_fd = -1;
+    DWORD m_dwFlags = PosixFileDefault;
+    size_t m_nPos = 0;
+
+    PosixFile::AlignedBuffer m_spDirectBuffer;
+    size_t m_nDirectLen = 0;
+  };
+
+  // Same API as on Windows. Implemented by PosixFileDataWriter
+  class FileDataWriter : public PosixFileDataWriter
+  {
+  };
+#endif // _WIN32
+
   template<typename T>
   class MemoryDataWriter : public DataWriter
   { 
@@ -182,7 +380,7 @@ namespace MZDR
       if (m_pData == nullptr || m_pCurPos == nullptr)
         return 0;
 
-      return m_pCurPos - m_pData.get();
+      return m_pCurPos - reinterpret_cast<BYTE*>(m_pData.get());
     }
     std::unique_ptr<T[]> StealData() { return std::move(m_pData); }
 
@@ -192,34 +390,119 @@ namespace MZDR
     BYTE* m_pEndPos;
     BYTE* m_pCurPos;
 
-    DWORD m_nCurrentLine = 0;
-    DWORD m_nCurLinePos = 0;
+    size_t m_nCurrentLine = 0;
+    size_t m_nCurLinePos = 0;
 
-    DWORD WriteNewLine() override
+    size_t WriteNewLine() override
     {
-      auto r = __super::WriteNewLine();
+      auto r = DataWriter::WriteNewLine();
       ++m_nCurrentLine;
       m_nCurLinePos = 0;
       return r;
     }
 
-    void WriteData(const BYTE* pBuffer, DWORD dwBytesToWrite, DWORD* dwBytesWritten) override
+    void WriteData(const BYTE* pBuffer, size_t nBytesToWrite, size_t* pBytesWritten) override
     {
-      if (m_pCurPos + dwBytesToWrite > m_pEndPos)
+      if (nBytesToWrite > static_cast<size_t>(m_pEndPos - m_pCurPos))
       {
-        dwBytesToWrite = static_cast<DWORD>(m_pEndPos - m_pCurPos); // makesure we do not write pass the end
+        nBytesToWrite = m_pEndPos - m_pCurPos; // makesure we do not write pass the end
       }
 
-      CopyMemory(m_pCurPos, pBuffer, dwBytesToWrite);
-      if (dwBytesWritten)
-        *dwBytesWritten = dwBytesToWrite;
+      CopyMemory(m_pCurPos, pBuffer, nBytesToWrite);
+      if (pBytesWritten)
+        *pBytesWritten = nBytesToWrite;
 
-      m_pCurPos += dwBytesToWrite;
+      m_pCurPos += nBytesToWrite;
     }
   
   };
 
 
+  //================================
+  // Convert newlines in all data written to another DataWriter. Like a FileDataWriter
+  //  Data is converted in large blocks. Call Flush() (or Close() to also close the target) after the last write
+  // T MUST be char or wchar_t
+  //================================
+
+  template<typename T>
+  class NewLineDataWriter : public DataWriter
+  {
+  public:
+    NewLineDataWriter(DataWriter* pTarget, NewLine newLine)
+      : m_pTarget(pTarget)
+      , m_Converter(newLine)
+    {
+      m_spBuffer = std::make_unique<T[]>(NewLineConverterT<T>::MaxConvertedChars(ChunkChars));
+    }
+
+    void Prepare(size_t dwExpectedDataSize) override
+    {
+      m_pTarget->Prepare(dwExpectedDataSize);
+    }
+
+    void Flush()
+    {
+      // Incomplete character at the end of data is written as is
+      if (m_nPartialBytes)
+        m_pTarget->WriteData(m_Partial, m_nPartialBytes);
+      m_nPartialBytes = 0;
+
+      m_Converter.Reset();
+    }
+
+    void Close() override
+    {
+      Flush();
+      m_pTarget->Close();
+    }
+
+  protected:
+    static const DWORD ChunkChars = 64 * 1024;
+
+    void WriteData(const BYTE* pBuffer, size_t nBytesToWrite, size_t* pBytesWritten) override
+    {
+      if (pBytesWritten)
+        *pBytesWritten = nBytesToWrite;
+
+      // Complete a character split between two writes
+      while (m_nPartialBytes && nBytesToWrite)
+      {
+        m_Partial[m_nPartialBytes++] = *pBuffer++;
+        nBytesToWrite--;
+        if (m_nPartialBytes == sizeof(T))
+        {
+          m_nPartialBytes = 0;
+          ConvertAndWrite(reinterpret_cast<const T*>(m_Partial), 1);
+        }
+      }
+
+      size_t nChars = nBytesToWrite / sizeof(T);
+      ConvertAndWrite(reinterpret_cast<const T*>(pBuffer), nChars);
+
+      for (size_t i = nChars * sizeof(T); i < nBytesToWrite; i++)
+        m_Partial[m_nPartialBytes++] = pBuffer[i];
+    }
+
+    void ConvertAndWrite(const T* pData, size_t nChars)
+    {
+      while (nChars)
+      {
+        size_t nChunk = nChars < ChunkChars ? nChars : ChunkChars;
+        size_t nOut = m_Converter.Convert(pData, pData + nChunk, m_spBuffer.get());
+        m_pTarget->WriteData(reinterpret_cast<const BYTE*>(m_spBuffer.get()), nOut * sizeof(T));
+
+        pData += nChunk;
+        nChars -= nChunk;
+      }
+    }
+
+    DataWriter* m_pTarget;
+    NewLineConverterT<T> m_Converter;
+    std::unique_ptr<T[]> m_spBuffer;
+    BYTE m_Partial[sizeof(T)];
+    DWORD m_nPartialBytes = 0;
+  };
+
   class LineDataWriter
   {
   public:
@@ -227,77 +510,257 @@ namespace MZDR
     template<class LineData>
     static void WriteLinesToFile(const STLString& filename, LineData& pData, bool bOverwrite, const BYTE* pNewLine = nullptr, DWORD dwNewLineLen = 0)
     {
-      DWORD fileOpenMode = bOverwrite ? CREATE_ALWAYS : CREATE_NEW;
+      FileDataWriter writer;
+      writer.OpenForWriting(filename, bOverwrite);
+      WriteLinesToDataWriter(&writer, pData, pNewLine, dwNewLineLen);
+    }
+
+    // Same as above. But all newlines are converted to convertNewLinesTo. T is the character type of the lines
+    template<typename T, class LineData>
+    static void WriteLinesToFile(const STLString& filename, LineData& pData, bool bOverwrite, NewLine convertNewLinesTo)
+    {
+      FileDataWriter writer;
+      writer.OpenForWriting(filename, bOverwrite);
+      WriteLinesToDataWriter<T>(&writer, pData, convertNewLinesTo);
+    }
+
+    template<typename T, class LineData>
+    static void WriteLinesToDataWriter(DataWriter* pWriter, LineData& pData, NewLine convertNewLinesTo)
+    {
+      NewLineDataWriter<T> converter(pWriter, convertNewLinesTo);
+      WriteLinesToDataWriter(&converter, pData);
+      converter.Flush();
+    }
+
+    // Write lines to any DataWriter (like PosixFileDataWriter). pNewLine is added to lines that have no newline
+    template<class LineData>
+    static void WriteLinesToDataWriter(DataWriter* pWriter, LineData& pData, const BYTE* pNewLine = nullptr, DWORD dwNewLineLen = 0)
+    {
+      LineBuffer buffer(pWriter, 32 * 1024, pNewLine, dwNewLineLen);
 
-      AutoHandle hFile(::CreateFile(filename.c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, fileOpenMode, 0, 0));
-      if (hFile.isValid() == false)
+      // ForEachLine works for LinesData and for views like LinesEditViewT
+      pData->ForEachLine([&](const auto& line)
       {
-        throw MZDataReaderException(::GetLastError(), "Unable to open file for writing");
-      }
+        buffer.Add(line);
+      });
 
-      const DWORD buffersize = 32 * 1024;
+      buffer.Flush();
+    }
 
-      auto spBuffer = std::make_unique<BYTE []>(buffersize);
-      DWORD availBufferSize = buffersize;
-      BYTE* pBufferPos = spBuffer.get();
+    // Creates the DataWriter for shard nShard (0 based). Called by multiple threads
+    typedef std::function<std::unique_ptr<DataWriter>(size_t nShard)> ShardWriterFactory;
 
-      auto& vLines = pData->GetLines();
+    // Split lines in to shard files named filename_0001.ext, filename_0002.ext ...
+    //  Shard boundaries are found first. Then all shards are written at the same time by nThreads threads (0 = one per core)
+    //  If bOverwrite is false, shard files that exist get a unique name. Returns the shard filenames in order
+    template<class LineData>
+    static std::vector<STLString> WriteLinesToShards(const STLString& filename, LineData& pData, ShardMode mode, size_t nShardValue, bool bOverwrite, size_t nThreads = 0)
+    {
+      std::vector<STLString> vFilenames;
+      WriteLinesToShards(GetShardFileFactory(filename, bOverwrite, vFilenames), pData, mode, nShardValue, nThreads);
+      return vFilenames;
+    }
+
+    // Same as above. But each shard is written to the DataWriter created by fnCreateWriter. Returns number of shards
+    template<class LineData>
+    static size_t WriteLinesToShards(const ShardWriterFactory& fnCreateWriter, LineData& pData, ShardMode mode, size_t nShardValue, size_t nThreads = 0)
+    {
+      if (nShardValue == 0)
+        throw MZDataReaderException(ERROR_INVALID_PARAMETER, "Shard size can not be 0");
+
+      auto&& vLines = pData->GetLines();
 
-      for (auto&& line : vLines)
+      // Index of first line in each shard + end
+      std::vector<size_t> vShardStart(1, 0);
+      if (mode == ShardByLineCount)
       {
-        if (line.GetLineData() == nullptr)
-          continue;
+        for (size_t nLine = nShardValue; nLine < vLines.size(); nLine += nShardValue)
+          vShardStart.push_back(nLine);
+      }
+      else
+      {
+        size_t nShardSize = 0;
+        for (size_t i = 0; i < vLines.size(); i++)
+        {
+          size_t len = vLines[i].GetLineDataLength();
+          if (nShardSize > 0 && nShardSize + len > nShardValue)
+          {
+            vShardStart.push_back(i);
+            nShardSize = 0;
+          }
+          nShardSize += len;
+        }
+      }
+      vShardStart.push_back(vLines.size());
+
+      ThreadPool pool(nThreads);
+      WriteShards(pool, vShardStart.size() - 1, fnCreateWriter, [&](size_t nShard, LineBuffer& buffer)
+      {
+        for (size_t i = vShardStart[nShard]; i < vShardStart[nShard + 1]; i++)
+          buffer.Add(vLines[i]);
+      });
+
+      return vShardStart.size() - 1;
+    }
+
+    // Split lines in to nShards files by key. A line is written to shard keyFn(line) % nShards. Lines keep their order in each shard
+    //  keyFn is called by multiple threads
+    template<class LineData, class KeyFn>
+    static std::vector<STLString> WriteLinesToShardsByKey(const STLString& filename, LineData& pData, size_t nShards, KeyFn keyFn, bool bOverwrite, size_t nThreads = 0)
+    {
+      std::vector<STLString> vFilenames;
+      WriteLinesToShardsByKey(GetShardFileFactory(filename, bOverwrite, vFilenames), pData, nShards, keyFn, nThreads);
+      return vFilenames;
+    }
+
+    // Same as above. But each shard is written to the DataWriter created by fnCreateWriter
+    template<class LineData, class KeyFn>
+    static void WriteLinesToShardsByKey(const ShardWriterFactory& fnCreateWriter, LineData& pData, size_t nShards, KeyFn keyFn, size_t nThreads = 0)
+    {
+      if (nShards == 0)
+        throw MZDataReaderException(ERROR_INVALID_PARAMETER, "Number of shards can not be 0");
+
+      auto&& vLines = pData->GetLines();
+      const size_t nLines = vLines.size();
+      const size_t nMinLinesPerBlock = 4096;
 
-        DWORD len = line.GetLineDataLength();
+      ThreadPool pool(nThreads);
 
-        if (len > availBufferSize)
+      size_t nBlocks = pool.NumThreads() * 4;
+      if (nBlocks > nLines / nMinLinesPerBlock)
+        nBlocks = nLines / nMinLinesPerBlock;
+      if (nBlocks < 1)
+        nBlocks = 1;
+      const size_t nLinesPerBlock = (nLines + nBlocks - 1) / nBlocks;
+
+      // Line indexes for each block and shard. Blocks are in line order so each shard keeps the line order
+      std::vector<std::vector<std::vector<size_t>>> vBlockShards(nBlocks, std::vector<std::vector<size_t>>(nShards));
+      pool.ParallelFor(nBlocks, [&](size_t nBlock)
+      {
+        size_t nFirst = nBlock * nLinesPerBlock;
+        size_t nEnd = (nFirst + nLinesPerBlock < nLines) ? nFirst + nLinesPerBlock : nLines;
+        for (size_t i = nFirst; i < nEnd; i++)
+          vBlockShards[nBlock][keyFn(vLines[i]) % nShards].push_back(i);
+      });
+
+      WriteShards(pool, nShards, fnCreateWriter, [&](size_t nShard, LineBuffer& buffer)
+      {
+        for (auto&& vShards : vBlockShards)
         {
-          // Write current buffer and continue
-          WriteFileThrow(hFile, spBuffer.get(), buffersize - availBufferSize);
-          availBufferSize = buffersize;
-          pBufferPos = spBuffer.get();
+          for (size_t i : vShards[nShard])
+            buffer.Add(vLines[i]);
         }
+      });
+    }
+
+  protected:
+    //================================
+    // Collect lines in a buffer. Buffer is written when it is full. Lines larger then the buffer are written directly
+    //================================
+
+    class LineBuffer
+    {
+    public:
+      LineBuffer(DataWriter* pWriter, size_t nBufferSize, const BYTE* pNewLine, DWORD dwNewLineLen)
+        : m_pWriter(pWriter)
+        , m_nBufferSize(nBufferSize)
+        , m_pNewLine(pNewLine)
+        , m_dwNewLineLen(dwNewLineLen)
+      {
+        m_spBuffer = std::make_unique<BYTE[]>(m_nBufferSize);
+        m_pBufferPos = m_spBuffer.get();
+        m_nAvail = m_nBufferSize;
+      }
 
-        CopyMemory(pBufferPos, line.GetLineData(), len);
-        pBufferPos += len;
+      template<class Line>
+      void Add(const Line& line)
+      {
+        if (line.GetLineData() == nullptr)
+          return;
+
+        size_t len = line.GetLineDataLength();
 
-        assert(availBufferSize >= len);
-        availBufferSize -= len;
+        if (len > m_nAvail)
+          Flush();
 
-        if (pNewLine)
+        if (len > m_nBufferSize)
         {
-          if (line.nBytesForNewLine == 0 && dwNewLineLen < availBufferSize)
-          {
-            if (dwNewLineLen > availBufferSize)
-            {
-              // Write current buffer and continue
-              WriteFileThrow(hFile, spBuffer.get(), buffersize - availBufferSize);
-              availBufferSize = buffersize;
-              pBufferPos = spBuffer.get();
-            }
-
-            CopyMemory(pBufferPos, pNewLine, dwNewLineLen);
-            pBufferPos += dwNewLineLen;
-            availBufferSize -= dwNewLineLen;
-          }
+          // Line do not fit in buffer. write it directly
+          m_pWriter->WriteData(line.GetLineData(), len);
+        }
+        else
+        {
+          CopyMemory(m_pBufferPos, line.GetLineData(), len);
+          m_pBufferPos += len;
+          m_nAvail -= len;
+        }
+
+        if (m_pNewLine && line.nBytesForNewLine == 0)
+        {
+          if (m_dwNewLineLen > m_nAvail)
+            Flush();
+
+          CopyMemory(m_pBufferPos, m_pNewLine, m_dwNewLineLen);
+          m_pBufferPos += m_dwNewLineLen;
+          m_nAvail -= m_dwNewLineLen;
         }
       }
 
-      if (availBufferSize != buffersize)
+      void Flush()
       {
-        WriteFileThrow(hFile, spBuffer.get(), buffersize - availBufferSize);
+        if (m_nAvail != m_nBufferSize)
+          m_pWriter->WriteData(m_spBuffer.get(), m_nBufferSize - m_nAvail);
+
+        m_pBufferPos = m_spBuffer.get();
+        m_nAvail = m_nBufferSize;
       }
+
+    protected:
+      DataWriter* m_pWriter;
+      std::unique_ptr<BYTE[]> m_spBuffer;
+      BYTE* m_pBufferPos;
+      size_t m_nBufferSize;
+      size_t m_nAvail;
+      const BYTE* m_pNewLine;
+      DWORD m_dwNewLineLen;
+    };
+
+    // FileDataWriter for each shard. Filename of each shard is added to vFilenames
+    static ShardWriterFactory GetShardFileFactory(const STLString& filename, bool bOverwrite, std::vector<STLString>& vFilenames)
+    {
+      auto spMutex = std::make_shared<std::mutex>();
+      return [filename, bOverwrite, &vFilenames, spMutex](size_t nShard) -> std::unique_ptr<DataWriter>
+      {
+        STLString strFilename = MCExtra::GetShardFilename(filename, nShard + 1, bOverwrite == false);
+        {
+          std::lock_guard<std::mutex> lock(*spMutex);
+          if (vFilenames.size() <= nShard)
+            vFilenames.resize(nShard + 1);
+          vFilenames[nShard] = strFilename;
+        }
+
+        auto spWriter = std::make_unique<FileDataWriter>();
+        spWriter->OpenForWriting(strFilename, bOverwrite);
+        return spWriter;
+      };
     }
 
-  protected:
-    static void WriteFileThrow(HANDLE hFile, const BYTE* pBuffer, DWORD dwBytesToWrite)
+    // fnWriteShard(nShard, LineBuffer& buffer) adds the lines of a shard to the buffer
+    template<class F>
+    static void WriteShards(ThreadPool& pool, size_t nShards, const ShardWriterFactory& fnCreateWriter, F fnWriteShard)
     {
-      DWORD dwBytesWritten;
-      if (WriteFile(hFile, pBuffer, dwBytesToWrite, &dwBytesWritten, nullptr) == FALSE)
+      const size_t nShardBufferSize = 1024 * 1024;
+
+      pool.ParallelFor(nShards, [&](size_t nShard)
       {
-        throw MZDataReaderException(::GetLastError(), "Failed to write data to file");
-      }
-    }   
+        std::unique_ptr<DataWriter> spWriter = fnCreateWriter(nShard);
+
+        LineBuffer buffer(spWriter.get(), nShardBufferSize, nullptr, 0);
+        fnWriteShard(nShard, buffer);
+        buffer.Flush();
+        spWriter->Close();
+      });
+    }
   };
 
 }
\ No newline at end of file
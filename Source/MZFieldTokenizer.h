@@ -0,0 +1,252 @@
+#pragma once
+
+#include <vector>
+#include "MZLinesData.h"
+#include "MZLineReader.h"
+#include "MZSimd.h"
+
+namespace MZDR
+{
+  // A record is one or more lines. It spans multiple lines when a quoted field contains a newline
+  struct FieldRecord
+  {
+    size_t nFirstLine = 0;
+    size_t nLineCount = 0;
+    size_t nFirstField = 0; // index in to field table
+    size_t nFields = 0;
+  };
+
+  //================================
+  // Split lines into delimited fields (CSV/TSV)
+  //  Delimiters and quotes are found 16 characters at a time using bitmasks.
+  //  Delimiters inside quotes are ignored. Field ranges include the quotes.
+  //  Lines can be tokenized while they are read (ReadAndTokenize), after they are read (Tokenize) or one record on demand (TokenizeRecordAt)
+  // T MUST be char or wchar_t
+  //================================
+
+  template<class T, class TLinesData>
+  class FieldTokenizerT
+  {
+  public:
+    FieldTokenizerT(T delimiter = ',', T quote = '"')
+      : m_Delimiter(delimiter)
+      , m_Quote(quote)
+    {
+    }
+
+    // Find delimiters in a line. Offsets (in characters) of the delimiters are added to vDelimiters
+    // Returns true if the line ends inside a quoted field. (the record continues on next line)
+    bool TokenizeLine(const T* pLine, size_t nChars, bool bInQuote, std::vector<size_t>& vDelimiters) const
+    {
+      typedef SimdHelperT<T> Simd;
+
+      DWORD nQuoteCarry = bInQuote ? 0xFFFF : 0;
+      size_t nOffset = 0;
+      T tail[Simd::BlockChars];
+
+      while (nOffset < nChars)
+      {
+        const T* pBlock = pLine + nOffset;
+        DWORD nValidMask = 0xFFFF;
+        size_t nLeft = nChars - nOffset;
+        if (nLeft < Simd::BlockChars)
+        {
+          // Last block. copy to a padded block so we never read past the line
+          ZeroMemory(tail, sizeof(tail));
+          CopyMemory(tail, pBlock, nLeft*sizeof(T));
+          pBlock = tail;
+          nValidMask = (1u << nLeft) - 1;
+        }
+
+        DWORD nQuoteMask = Simd::MatchMask(pBlock, m_Quote) & nValidMask;
+        DWORD nDelimMask = Simd::MatchMask(pBlock, m_Delimiter) & nValidMask;
+
+        DWORD nInsideQuote = Simd::PrefixXor(nQuoteMask) ^ nQuoteCarry;
+        nDelimMask &= ~nInsideQuote;
+        nQuoteCarry = (nInsideQuote & 0x8000) ? 0xFFFF : 0;
+
+        while (nDelimMask)
+        {
+          vDelimiters.push_back(nOffset + Simd::LowestBit(nDelimMask));
+          nDelimMask &= nDelimMask - 1;
+        }
+
+        nOffset += Simd::BlockChars;
+      }
+
+      return nQuoteCarry != 0;
+    }
+
+    // Read and tokenize in one pass. Fields are found when each line is parsed, while it is in the cache
+    std::shared_ptr<TLinesData> ReadAndTokenize(LineReaderT<T, TLinesData>& reader, MZDR::DataReader* pReader, MZDR::LineParser* pLineParser, MZDR::ContentFormat format = MZDR::ContentUnknown)
+    {
+      Reset();
+      reader.SetLineCallback([this](const MZDR::ParseLineResult& line) { AddLine(reinterpret_cast<const T*>(line.pLine), line.length / sizeof(T)); });
+
+      std::shared_ptr<TLinesData> spLinesData;
+      try
+      {
+        spLinesData = reader.ReadLinesFromDataReader(pReader, pLineParser, format);
+      }
+      catch (...)
+      {
+        reader.SetLineCallback(nullptr);
+        throw;
+      }
+
+      reader.SetLineCallback(nullptr);
+      Finish();
+      return spLinesData;
+    }
+
+    // Tokenize all lines of an already read LinesData
+    void Tokenize(TLinesData& linesData)
+    {
+      Reset();
+
+      auto& vLines = linesData.GetLines();
+      m_vRecords.reserve(vLines.size());
+
+      for (auto&& line : vLines)
+        AddLine(reinterpret_cast<const T*>(line.pLine), line.lenght / sizeof(T));
+
+      Finish();
+    }
+
+    // Incremental tokenizing. Call AddLine for each line in order, then Finish()
+    void Reset()
+    {
+      m_vRecords.clear();
+      m_vFields.clear();
+      m_Record = FieldRecord();
+      m_FieldStart = TextPos(0, 0);
+      m_bInQuote = false;
+      m_nLines = 0;
+      m_nLastLineChars = 0;
+    }
+
+    void AddLine(const T* pLine, size_t nChars)
+    {
+      size_t nLine = m_nLines++;
+      m_nLastLineChars = nChars;
+
+      if (m_bInQuote == false)
+      {
+        m_Record.nFirstLine = nLine;
+        m_Record.nFirstField = m_vFields.size();
+        m_FieldStart = TextPos(nLine, 0);
+      }
+
+      m_vDelimiters.clear();
+      m_bInQuote = TokenizeLine(pLine, nChars, m_bInQuote, m_vDelimiters);
+
+      for (auto nDelimiter : m_vDelimiters)
+      {
+        m_vFields.push_back(TextRange(m_FieldStart.nLine, m_FieldStart.nLineOffset, nLine, nDelimiter));
+        m_FieldStart = TextPos(nLine, nDelimiter + 1);
+      }
+
+      if (m_bInQuote == false)
+        AddRecord(nLine, nChars);
+    }
+
+    // Unterminated quote. Last field continues to end of data
+    void Finish()
+    {
+      if (m_bInQuote && m_nLines > 0)
+        AddRecord(m_nLines - 1, m_nLastLineChars);
+      m_bInQuote = false;
+    }
+
+    // On demand. Tokenize the record that starts at nFirstLine without storing it. Fields are added to vFields.
+    //  Returns number of lines used by the record (more then one if a quoted field contains a newline)
+    size_t TokenizeRecordAt(TLinesData& linesData, size_t nFirstLine, std::vector<TextRange>& vFields) const
+    {
+      auto& vLines = linesData.GetLines();
+      std::vector<size_t> vDelimiters;
+      TextPos fieldStart(nFirstLine, 0);
+      bool bInQuote = false;
+
+      size_t nLine = nFirstLine;
+      for (; nLine < vLines.size(); nLine++)
+      {
+        auto& line = vLines[nLine];
+        size_t nChars = line.lenght / sizeof(T);
+
+        vDelimiters.clear();
+        bInQuote = TokenizeLine(reinterpret_cast<const T*>(line.pLine), nChars, bInQuote, vDelimiters);
+        for (auto nDelimiter : vDelimiters)
+        {
+          vFields.push_back(TextRange(fieldStart.nLine, fieldStart.nLineOffset, nLine, nDelimiter));
+          fieldStart = TextPos(nLine, nDelimiter + 1);
+        }
+
+        if (bInQuote == false || nLine + 1 == vLines.size())
+        {
+          vFields.push_back(TextRange(fieldStart.nLine, fieldStart.nLineOffset, nLine, nChars));
+          break;
+        }
+      }
+
+      return (nLine < vLines.size()) ? nLine - nFirstLine + 1 : 0;
+    }
+
+    size_t NumRecords() const { return m_vRecords.size(); }
+
+    const FieldRecord& GetRecord(size_t nRecord) const
+    {
+      return m_vRecords.at(nRecord);
+    }
+
+    // Returns false if field do not exists
+    bool GetField(size_t nRecord, size_t nField, TextRange& range) const
+    {
+      auto& record = m_vRecords.at(nRecord);
+      if (nField >= record.nFields)
+        return false;
+
+      range = m_vFields[record.nFirstField + nField];
+      return true;
+    }
+
+    // Get pointer to the field data. Only possible if field is not spanning multiple lines.
+    bool GetFieldData(TLinesData& linesData, size_t nRecord, size_t nField, const T** ppField, size_t* pnChars) const
+    {
+      TextRange range;
+      if (GetField(nRecord, nField, range) == false)
+        return false;
+
+      if (range.start.nLine != range.end.nLine)
+        return false;
+
+      auto pLine = linesData.GetLine(range.start.nLine);
+      *ppField = reinterpret_cast<const T*>(pLine->pLine) + range.start.nLineOffset;
+      *pnChars = range.end.nLineOffset - range.start.nLineOffset;
+      return true;
+    }
+
+  protected:
+    void AddRecord(size_t nLastLine, size_t nLastLineChars)
+    {
+      m_vFields.push_back(TextRange(m_FieldStart.nLine, m_FieldStart.nLineOffset, nLastLine, nLastLineChars));
+      m_Record.nLineCount = nLastLine - m_Record.nFirstLine + 1;
+      m_Record.nFields = m_vFields.size() - m_Record.nFirstField;
+      m_vRecords.push_back(m_Record);
+    }
+
+    T m_Delimiter;
+    T m_Quote;
+
+    std::vector<FieldRecord> m_vRecords;
+    std::vector<TextRange> m_vFields;
+
+    // State of the record being tokenized by AddLine
+    FieldRecord m_Record;
+    TextPos m_FieldStart = TextPos(0, 0);
+    bool m_bInQuote = false;
+    size_t m_nLines = 0;
+    size_t m_nLastLineChars = 0;
+    std::vector<size_t> m_vDelimiters;
+  };
+
+}
@@ -0,0 +1,346 @@
+#pragma once
+
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+
+#include "MZLinesData.h"
+#include "MZLineParser.h"
+#include "MZDataReader.h"
+#include "MZMemoryBudget.h"
+
+namespace MZDR
+{
+  //================================
+  // Read only lines where only the offset of each line is kept in memory.
+  //  Line data is read with DataReader::ReadDataAtThrow through a small LRU page cache.
+  //  Used by LineReaderT::ReadLinesFromDataReaderWithBudget when the data do not fit in the memory budget.
+  //  Can continue from lines LineReaderT has already parsed
+  // T MUST be char or wchar_t
+  //================================
+
+  template<class T, class TLinesData>
+  class FileBackedLinesDataT
+  {
+  public:
+    typedef typename TLinesData::LineType Line;
+
+    // Line with a reference to the page data. The line is valid for as long as the LineRef exists
+    class LineRef
+    {
+    public:
+      LineRef(std::shared_ptr<const BYTE> spData, const Line& line)
+        : m_spData(std::move(spData))
+        , m_Line(line)
+      {
+      }
+
+      const Line& operator*() const { return m_Line; }
+      const Line* operator->() const { return &m_Line; }
+
+    protected:
+      std::shared_ptr<const BYTE> m_spData;
+      Line m_Line;
+    };
+
+    static const DWORD PageSize = 64 * 1024;
+
+    // spReader MUST support ReadDataAtThrow. All data is scanned once to build the line index.
+    //  nCachePages is number of pages to keep in memory
+    FileBackedLinesDataT(std::shared_ptr<MZDR::DataReader> spReader, MZDR::LineParser* pLineParser, MZDR::ContentFormat format = MZDR::ContentUnknown, size_t nCachePages = 16)
+      : m_spReader(std::move(spReader))
+      , m_ContentFormat(format)
+      , m_nCachePages(nCachePages > 0 ? nCachePages : 1)
+    {
+      m_nDataEnd = (m_spReader->TotalDataSize() / sizeof(T)) * sizeof(T);
+
+      pLineParser->WithNewLinePolicy([this](auto policy)
+      {
+        this->template BuildIndex<MZDR::LineParserT<T, decltype(policy)>>(0);
+        return 0;
+      });
+
+      m_vItems.shrink_to_fit();
+      UpdateMemoryCharge();
+    }
+
+    // Continue a read that was stopped. Lines in parsed are kept as offsets and the data from nScanOffset is scanned.
+    //  Buffer i of parsed starts at vBufferOffsets[i] in the data. parsed is empty after this
+    FileBackedLinesDataT(std::shared_ptr<MZDR::DataReader> spReader, MZDR::LineParser* pLineParser, TLinesData& parsed, const std::vector<uint64_t>& vBufferOffsets, uint64_t nScanOffset,
+      MZDR::ContentFormat format = MZDR::ContentUnknown, size_t nCachePages = 16)
+      : m_spReader(std::move(spReader))
+      , m_ContentFormat(format)
+      , m_nCachePages(nCachePages > 0 ? nCachePages : 1)
+    {
+      m_nDataEnd = (m_spReader->TotalDataSize() / sizeof(T)) * sizeof(T);
+      AddParsedLines(parsed, vBufferOffsets);
+
+      pLineParser->WithNewLinePolicy([this, nScanOffset](auto policy)
+      {
+        this->template BuildIndex<MZDR::LineParserT<T, decltype(policy)>>(nScanOffset);
+        return 0;
+      });
+
+      m_vItems.shrink_to_fit();
+      UpdateMemoryCharge();
+    }
+
+    FileBackedLinesDataT(const FileBackedLinesDataT&) = delete;
+    FileBackedLinesDataT& operator=(const FileBackedLinesDataT&) = delete;
+
+    MZDR::ContentFormat ContentFormat() const { return m_ContentFormat; }
+
+    size_t NumLines() const { return m_vItems.size(); }
+
+    LineRef GetLine(size_t nIdx) const
+    {
+      const LineEntry& entry = m_vItems.at(nIdx);
+      uint64_t nPage = entry.nOffset / PageSize;
+      size_t nPageOffset = static_cast<size_t>(entry.nOffset % PageSize);
+
+      // Line in one page. Line larger then a page (or split by a page border) is read by itself
+      if (nPageOffset + static_cast<size_t>(entry.nLength) + entry.nBytesForNewLine <= PageSize)
+      {
+        auto spPage = GetPage(nPage);
+        Line line = MakeLine(spPage.get() + nPageOffset, entry);
+        return LineRef(std::move(spPage), line);
+      }
+
+      size_t nSize = static_cast<size_t>(entry.nLength) + entry.nBytesForNewLine;
+      std::shared_ptr<BYTE> spData(new BYTE[nSize > 0 ? nSize : 1], [](BYTE* p) { delete[] p; });
+      ReadAt(entry.nOffset, spData.get(), nSize);
+
+      Line line = MakeLine(spData.get(), entry);
+      return LineRef(std::move(spData), line);
+    }
+
+    // Call fn(const Line& line) for each line in order. Data is read sequentially and not added to the page cache
+    template<class F>
+    void ForEachLine(F fn) const
+    {
+      std::vector<BYTE> vBuffer;
+      uint64_t nBufStart = 0;
+      size_t nBufSize = 0;
+      for (auto&& entry : m_vItems)
+      {
+        size_t nSize = static_cast<size_t>(entry.nLength) + entry.nBytesForNewLine;
+        if (entry.nOffset < nBufStart || entry.nOffset + nSize > nBufStart + nBufSize)
+        {
+          nBufStart = entry.nOffset;
+          nBufSize = (nSize > ForEachChunkSize) ? nSize : ForEachChunkSize;
+          if (nBufStart + nBufSize > m_nDataEnd)
+            nBufSize = static_cast<size_t>(m_nDataEnd - nBufStart);
+
+          if (vBuffer.size() < nBufSize)
+            vBuffer.resize(nBufSize);
+          ReadAt(nBufStart, vBuffer.data(), nBufSize);
+        }
+
+        fn(MakeLine(vBuffer.data() + (entry.nOffset - nBufStart), entry));
+      }
+    }
+
+    // Memory used by the line index and the page cache. Also counted in MemoryBudget::Global()
+    MemoryUsageInfo MemoryUsage() const
+    {
+      std::lock_guard<std::mutex> lock(m_CacheMutex);
+
+      MemoryUsageInfo info;
+      info.nBufferBytes = m_LruList.size() * PageSize;
+      info.nIndexBytes = m_vItems.size() * sizeof(LineEntry);
+      info.nIndexSlackBytes = (m_vItems.capacity() - m_vItems.size()) * sizeof(LineEntry);
+      info.nOtherBytes = m_Cache.size() * sizeof(CacheEntry);
+      return info;
+    }
+
+    // Size of the data read by the DataReader
+    uint64_t DataSize() const { return m_nDataEnd; }
+
+  protected:
+    static const DWORD ScanChunkSize = 256 * 1024;
+    static const DWORD ForEachChunkSize = 1024 * 1024;
+
+    struct LineEntry
+    {
+      uint64_t nOffset;
+      DWORD nLength;
+      BYTE nBytesForNewLine;
+      BYTE newLine;
+    };
+
+    struct CacheEntry
+    {
+      std::shared_ptr<const BYTE> spData;
+      std::list<uint64_t>::iterator itLru;
+    };
+
+    // Lines of parsed are in buffer order. Only the position of each line is kept. Buffers of parsed are freed
+    void AddParsedLines(TLinesData& parsed, const std::vector<uint64_t>& vBufferOffsets)
+    {
+      if (vBufferOffsets.size() != parsed.NumBuffers())
+        throw MZDataReaderException(ERROR_INVALID_PARAMETER, "Offset is needed for each buffer");
+
+      m_vItems.reserve(parsed.NumLines());
+
+      size_t nBuffer = 0;
+      for (auto&& line : parsed.GetLines())
+      {
+        while (nBuffer < parsed.NumBuffers() && (line.pLine < parsed.GetBuffer(nBuffer)
+          || line.pLine + line.lenght + line.nBytesForNewLine > parsed.GetBuffer(nBuffer) + parsed.GetBufferSize(nBuffer)))
+          nBuffer++;
+
+        if (nBuffer == parsed.NumBuffers())
+          throw MZDataReaderException(ERROR_INVALID_DATA, "Line data is not in a buffer owned by the LinesData");
+        if (static_cast<uint64_t>(line.lenght) > 0xFFFFFFFF)
+          throw MZDataReaderException(ERROR_ARITHMETIC_OVERFLOW, "Line is too long for the file backed line index");
+
+        LineEntry entry;
+        entry.nOffset = vBufferOffsets[nBuffer] + (line.pLine - parsed.GetBuffer(nBuffer));
+        entry.nLength = static_cast<DWORD>(line.lenght);
+        entry.nBytesForNewLine = line.nBytesForNewLine;
+        entry.newLine = static_cast<BYTE>(line.nBytesForNewLine ? line.newLine : NoNewLine);
+        m_vItems.push_back(entry);
+      }
+
+      std::vector<std::unique_ptr<BYTE[]>> vBuffers;
+      std::vector<size_t> vBufferSizes;
+      parsed.DetachBuffers(vBuffers, vBufferSizes);
+    }
+
+    // Same lines as LineReaderT would create. Only the position of each line is kept. Scan start at nStartOffset
+    template<class TParser>
+    void BuildIndex(uint64_t nStartOffset)
+    {
+      std::vector<BYTE> vBuffer(ScanChunkSize);
+      uint64_t nBufStart = nStartOffset;   // Offset of vBuffer[0] in the data
+      size_t nValid = 0;        // Bytes in vBuffer
+
+      while (nBufStart + nValid < m_nDataEnd)
+      {
+        uint64_t nReadPos = nBufStart + nValid;
+        size_t nRead = ScanChunkSize;
+        if (nReadPos + nRead > m_nDataEnd)
+          nRead = static_cast<size_t>(m_nDataEnd - nReadPos);
+
+        // Line is larger then the chunk. Grow the buffer so we can read more of it
+        if (vBuffer.size() < nValid + nRead)
+          vBuffer.resize((nValid + nRead) * 2);
+
+        ReadAt(nReadPos, vBuffer.data() + nValid, nRead);
+        nValid += nRead;
+
+        bool bLastChunk = (nBufStart + nValid >= m_nDataEnd);
+
+        const BYTE* pBuffer = vBuffer.data();
+        const BYTE* pEnd = pBuffer + nValid;
+        const BYTE* pLineStart = pBuffer;
+        while (pLineStart)
+        {
+          MZDR::ParseLineResult result = TParser::ParseLine(reinterpret_cast<const T*>(pLineStart), reinterpret_cast<const T*>(pEnd));
+          if (result.pLine == nullptr)
+          {
+            pLineStart = pEnd;
+            break;
+          }
+
+          if (result.bEndOfDataReached && bLastChunk == false)
+            break; // Incomplete line. Keep it for the next chunk
+
+          // Entry is kept small. Lines over 4 GB are not supported
+          if (result.length > 0xFFFFFFFF)
+            throw MZDataReaderException(ERROR_ARITHMETIC_OVERFLOW, "Line is too long for the file backed line index");
+
+          LineEntry entry;
+          entry.nOffset = nBufStart + (result.pLine - pBuffer);
+          entry.nLength = static_cast<DWORD>(result.length);
+          entry.nBytesForNewLine = static_cast<BYTE>(result.nCharsForNewLine * sizeof(T));
+          entry.newLine = static_cast<BYTE>(result.nCharsForNewLine ? result.newLineChars : NoNewLine);
+          m_vItems.push_back(entry);
+
+          pLineStart = result.pNextLine;
+        }
+
+        if (pLineStart == nullptr)
+          pLineStart = pEnd;
+
+        // Move the incomplete line to the start of the buffer
+        size_t nCarry = pEnd - pLineStart;
+        if (nCarry)
+          MoveMemory(vBuffer.data(), pLineStart, nCarry);
+        nBufStart += (pLineStart - pBuffer);
+        nValid = nCarry;
+
+        if (bLastChunk)
+          break;
+      }
+    }
+
+    std::shared_ptr<const BYTE> GetPage(uint64_t nPage) const
+    {
+      std::lock_guard<std::mutex> lock(m_CacheMutex);
+      auto it = m_Cache.find(nPage);
+      if (it != m_Cache.end())
+      {
+        m_LruList.splice(m_LruList.begin(), m_LruList, it->second.itLru);
+        return it->second.spData;
+      }
+
+      uint64_t nPageStart = nPage * PageSize;
+      size_t nSize = PageSize;
+      if (nPageStart + nSize > m_nDataEnd)
+        nSize = static_cast<size_t>(m_nDataEnd - nPageStart);
+
+      std::shared_ptr<BYTE> spData(new BYTE[PageSize], [](BYTE* p) { delete[] p; });
+      ReadAt(nPageStart, spData.get(), nSize);
+
+      m_LruList.push_front(nPage);
+      m_Cache[nPage] = CacheEntry{ spData, m_LruList.begin() };
+
+      if (m_LruList.size() > m_nCachePages)
+      {
+        m_Cache.erase(m_LruList.back());
+        m_LruList.pop_back();
+      }
+
+      UpdateMemoryCharge();
+      return spData;
+    }
+
+    // DataReader is not thread safe. Reads are serialized
+    void ReadAt(uint64_t nOffset, BYTE* pBuffer, size_t nSize) const
+    {
+      std::lock_guard<std::mutex> lock(m_ReadMutex);
+      size_t nBytesRead = 0;
+      m_spReader->ReadDataAtThrow(static_cast<size_t>(nOffset), pBuffer, nSize, &nBytesRead);
+      if (nBytesRead != nSize)
+        throw MZDataReaderException(ERROR_HANDLE_EOF, "Unexpected end of data");
+    }
+
+    // Cache pages are counted when they are added. Pages still used by a LineRef after they are removed are not counted
+    void UpdateMemoryCharge() const
+    {
+      m_MemoryCharge.Set(m_vItems.capacity() * sizeof(LineEntry) + m_LruList.size() * PageSize);
+    }
+
+    static Line MakeLine(const BYTE* pLine, const LineEntry& entry)
+    {
+      return Line(pLine, entry.nLength, static_cast<NewLine>(entry.newLine), entry.nBytesForNewLine);
+    }
+
+    std::shared_ptr<MZDR::DataReader> m_spReader;
+    std::vector<LineEntry> m_vItems;
+    uint64_t m_nDataEnd = 0;
+    MZDR::ContentFormat m_ContentFormat = MZDR::ContentUnknown;
+
+    size_t m_nCachePages;
+    mutable std::mutex m_CacheMutex;
+    mutable std::mutex m_ReadMutex;
+    mutable std::list<uint64_t> m_LruList;
+    mutable std::unordered_map<uint64_t, CacheEntry> m_Cache;
+    mutable MemoryCharge m_MemoryCharge;
+  };
+
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+#include "MZPlatform.h"
+#include "MZDataReaderException.h"
+
+namespace MZDR
+{
+  // Sizes are 64 bit. Readers and writers split large reads and writes in to chunks of MaxIoChunkSize for each system call
+  const DWORD MaxIoChunkSize = 1024 * 1024 * 1024;
+}
+
+#ifndef _WIN32
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <string>
+#include <memory>
+
+namespace MZDR
+{
+  enum PosixFileFlags
+  {
+    PosixFileDefault = 0,
+    PosixFileDirectIO = 1,      // O_DIRECT. Bypass the page cache. Use for one-shot scans of large files
+    PosixFileDropCache = 2,     // Tell the kernel to drop pages that have been read/written
+  };
+
+  //================================
+  // Helpers for the POSIX file backend
+  //================================
+
+  class PosixFile
+  {
+  public:
+    static const size_t DirectIOAlignment = 4096;
+    static const size_t DirectIOBufferSize = 1024 * 1024;
+
+    struct FreeDeleter
+    {
+      void operator()(BYTE* p) const { free(p); }
+    };
+    typedef std::unique_ptr<BYTE, FreeDeleter> AlignedBuffer;
+
+    static AlignedBuffer AllocateAligned(size_t nSize)
+    {
+      void* p = nullptr;
+      if (posix_memalign(&p, DirectIOAlignment, nSize) != 0)
+        throw MZDataReaderException(ERROR_NOT_ENOUGH_MEMORY, "Failed to allocate aligned buffer");
+      return AlignedBuffer(static_cast<BYTE*>(p));
+    }
+
+    // Open with O_DIRECT if requested. Falls back to normal I/O if the filesystem do not support it
+    static int Open(const std::string& filename, int flags, DWORD& dwFileFlags)
+    {
+      int fd = -1;
+#ifdef O_DIRECT
+      if (dwFileFlags & PosixFileDirectIO)
+      {
+        fd = ::open(filename.c_str(), flags | O_DIRECT | O_CLOEXEC, 0644);
+        if (fd >= 0 || errno != EINVAL)
+          return fd;
+
+        // O_DIRECT is checked after the file is created. So the file did not exist and was created by the call above
+        flags &= ~O_EXCL;
+      }
+#endif
+      dwFileFlags &= ~PosixFileDirectIO;
+      fd = ::open(filename.c_str(), flags | O_CLOEXEC, 0644);
+      return fd;
+    }
+
+    // Read until nBytes is read or end of file. Returns number of bytes read. At most MaxIoChunkSize for each call
+    static size_t ReadThrow(int fd, BYTE* pBuffer, size_t nBytes, off_t offset)
+    {
+      size_t nTotal = 0;
+      while (nTotal < nBytes)
+      {
+        size_t nChunk = (nBytes - nTotal > MaxIoChunkSize) ? MaxIoChunkSize : nBytes - nTotal;
+        ssize_t n = ::pread(fd, pBuffer + nTotal, nChunk, offset + nTotal);
+        if (n < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          throw MZDataReaderException(errno, "Failed to read file");
+        }
+        if (n == 0)
+          break;
+
+        nTotal += n;
+      }
+      return nTotal;
+    }
+
+    static void WriteThrow(int fd, const BYTE* pBuffer, size_t nBytes, off_t offset)
+    {
+      size_t nTotal = 0;
+      while (nTotal < nBytes)
+      {
+        size_t nChunk = (nBytes - nTotal > MaxIoChunkSize) ? MaxIoChunkSize : nBytes - nTotal;
+        ssize_t n = ::pwrite(fd, pBuffer + nTotal, nChunk, offset + nTotal);
+        if (n < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          throw MZDataReaderException(errno, "Failed to write data to file");
+        }
+        nTotal += n;
+      }
+    }
+  };
+
+}
+
+#endif // _WIN32
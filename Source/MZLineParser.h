@@ -1,10 +1,12 @@
 #pragma once
 
+#include <cstring>
+#include <cwchar>
 #include "MZLinesData.h"
+#include "MZSimd.h"
 
 namespace MZDR
 {
-  enum NewLine;
     // T MUST be char or wchar_t
   struct ParseLineResult
   {
@@ -19,83 +21,227 @@ namespace MZDR
 
     const BYTE* pLine;
     const BYTE* pNextLine;
-    DWORD length;
+    size_t length;
     BYTE nCharsForNewLine; // 0,1,2  - 2 if newline was two characters. (CRLF)
     NewLine newLineChars;
     bool bEndOfDataReached;
 
   };
-  
-  template<class T>
-  class LineParserT
+
+  //================================
+  // Newline policies for LineParserT
+  //  FindLineEnd set pLineEnd to the newline (or pEnd) and returns false if more data is needed to know where the line ends
+  //  Style is the newline style the policy finds. Unknown for any style
+  //================================
+
+  class NewLinePolicyHelper
   {
   public:
-    static ParseLineResult ParseLine(const T* pBegin, const T* pEndOfData)
-      {
-        ParseLineResult result;
+    static const char* FindChar(const char* pData, const char* pEnd, char ch)
+    {
+      auto p = static_cast<const char*>(memchr(pData, ch, pEnd - pData));
+      return p ? p : pEnd;
+    }
+    static const wchar_t* FindChar(const wchar_t* pData, const wchar_t* pEnd, wchar_t ch)
+    {
+      auto p = wmemchr(pData, ch, pEnd - pData);
+      return p ? p : pEnd;
+    }
+  };
+
+  // Newline is LF. CR is part of the line data
+  struct NewLinePolicyLF
+  {
+    static const NewLine Style = LF;
+
+    template<class T>
+    static bool FindLineEnd(const T* pData, const T* pEnd, const T*& pLineEnd, BYTE& nChars, NewLine& newLine)
+    {
+      pLineEnd = NewLinePolicyHelper::FindChar(pData, pEnd, static_cast<T>(0x0a));
+      if (pLineEnd == pEnd)
+        return false;
+
+      nChars = 1;
+      newLine = LF;
+      return true;
+    }
+
+    template<class T>
+    static size_t CountNewLines(const T* pData, const T* pEnd)
+    {
+      return SimdHelperT<T>::Count(pData, pEnd, static_cast<T>(0x0a));
+    }
+
+    // Returns position after the last newline. pBegin if no newline was found
+    template<class T>
+    static const T* FindLastLineEnd(const T* pBegin, const T* pEnd)
+    {
+      while (pEnd > pBegin && *(pEnd - 1) != 0x0a)
+        pEnd--;
+      return pEnd;
+    }
+  };
+
+  // Newline is CR. LF is part of the line data
+  struct NewLinePolicyCR
+  {
+    static const NewLine Style = CR;
 
-//        const T*  pLineBegin = pBegin;
-        const T*  pLineEnd = nullptr;
-//        DWORD   dwLineLength = 0;
-//        short   dwLineFlags = 0;
+    template<class T>
+    static bool FindLineEnd(const T* pData, const T* pEnd, const T*& pLineEnd, BYTE& nChars, NewLine& newLine)
+    {
+      pLineEnd = NewLinePolicyHelper::FindChar(pData, pEnd, static_cast<T>(0x0d));
+      if (pLineEnd == pEnd)
+        return false;
 
-        T* pData = (T*) pBegin;
+      nChars = 1;
+      newLine = CR;
+      return true;
+    }
 
-        if (pData >= pEndOfData)
+    template<class T>
+    static size_t CountNewLines(const T* pData, const T* pEnd)
+    {
+      return SimdHelperT<T>::Count(pData, pEnd, static_cast<T>(0x0d));
+    }
+
+    template<class T>
+    static const T* FindLastLineEnd(const T* pBegin, const T* pEnd)
+    {
+      while (pEnd > pBegin && *(pEnd - 1) != 0x0d)
+        pEnd--;
+      return pEnd;
+    }
+  };
+
+  // Newline is CRLF. A CR or LF by itself is part of the line data
+  struct NewLinePolicyCRLF
+  {
+    static const NewLine Style = CRLF;
+
+    template<class T>
+    static bool FindLineEnd(const T* pData, const T* pEnd, const T*& pLineEnd, BYTE& nChars, NewLine& newLine)
+    {
+      const T* p = pData;
+      for (;;)
+      {
+        p = NewLinePolicyHelper::FindChar(p, pEnd, static_cast<T>(0x0d));
+        if (p == pEnd || p + 1 == pEnd)
         {
-          result.Clear();
-          result.bEndOfDataReached = true;
-          return result;
+          // No CR, or CR is last character and LF might be in next chunk
+          pLineEnd = pEnd;
+          return false;
         }
 
-        // Find CR or LF character
-        while (pData < pEndOfData && *pData != 0x0a && *pData != 0x0d)
+        if (*(p + 1) == 0x0a)
         {
-          pData++;
+          pLineEnd = p;
+          nChars = 2;
+          newLine = CRLF;
+          return true;
         }
+        p++;
+      }
+    }
 
-        // if pData == pDataEnd. then we reach the end of the buffert. 
-        //  find out if we at the EOD. if we are then it is okey. else we need to stop
-        if (pData == pEndOfData)
-          result.bEndOfDataReached = true;
-        else
-          result.bEndOfDataReached = false;
+    template<class T>
+    static size_t CountNewLines(const T* pData, const T* pEnd)
+    {
+      return SimdHelperT<T>::CountPairs(pData, pEnd, static_cast<T>(0x0d), static_cast<T>(0x0a));
+    }
 
-        pLineEnd = pData;
+    template<class T>
+    static const T* FindLastLineEnd(const T* pBegin, const T* pEnd)
+    {
+      while (pEnd - pBegin >= 2 && (*(pEnd - 1) != 0x0a || *(pEnd - 2) != 0x0d))
+        pEnd--;
+      return (pEnd - pBegin >= 2) ? pEnd : pBegin;
+    }
+  };
 
-        if (pData < pEndOfData && pData <= pEndOfData)
-        {
-          if (*pData == 0x0d && *(pData + 1) == 0x0a)
-          {
-            pData += 2;
-            result.nCharsForNewLine = 2;
-            result.newLineChars = MZDR::CRLF;
-          }
-          else if (*pData == 0x0a)
-          {
-            pData++;
-            result.nCharsForNewLine = 1;
-            result.newLineChars = LF;
-          }
-          else
-          {
-            result.nCharsForNewLine = 0;
-            result.newLineChars = NoNewLine;
-          }
-        }
-        else
+  // LF, CRLF and CR. Can be mixed in the same data
+  struct NewLinePolicyAuto
+  {
+    static const NewLine Style = Unknown;
+
+    template<class T>
+    static bool FindLineEnd(const T* pData, const T* pEnd, const T*& pLineEnd, BYTE& nChars, NewLine& newLine)
+    {
+      pLineEnd = SimdHelperT<T>::FindFirstOf(pData, pEnd, static_cast<T>(0x0a), static_cast<T>(0x0d));
+      if (pLineEnd == pEnd)
+        return false;
+
+      if (*pLineEnd == 0x0a)
+      {
+        nChars = 1;
+        newLine = LF;
+        return true;
+      }
+
+      if (pLineEnd + 1 < pEnd && *(pLineEnd + 1) == 0x0a)
+      {
+        nChars = 2;
+        newLine = CRLF;
+        return true;
+      }
+
+      nChars = 1;
+      newLine = CR;
+
+      // CR is last character. It is CRLF if next chunk start with LF
+      return pLineEnd + 1 < pEnd;
+    }
+
+    template<class T>
+    static size_t CountNewLines(const T* pData, const T* pEnd)
+    {
+      return SimdHelperT<T>::CountNewLines(pData, pEnd);
+    }
+
+    // A CR as last character is not a complete line end. It might be followed by LF
+    template<class T>
+    static const T* FindLastLineEnd(const T* pBegin, const T* pEnd)
+    {
+      const T* p = pEnd;
+      while (p > pBegin)
+      {
+        T ch = *(p - 1);
+        if (ch == 0x0a || (ch == 0x0d && p != pEnd))
+          break;
+        p--;
+      }
+      return p;
+    }
+  };
+
+  template<class T, class TNewLinePolicy = NewLinePolicyAuto>
+  class LineParserT
+  {
+  public:
+    static ParseLineResult ParseLine(const T* pBegin, const T* pEndOfData)
+      {
+        ParseLineResult result;
+
+        if (pBegin >= pEndOfData)
         {
-          result.nCharsForNewLine = 0;
-          result.newLineChars = NoNewLine;
+          result.Clear();
+          result.bEndOfDataReached = true;
+          return result;
         }
 
-        // pData is still pointing at same char. can't be right..
-        if (pLineEnd == pData && pData < pEndOfData)
-          pData++;
+        const T* pLineEnd = nullptr;
+        BYTE nChars = 0;
+        NewLine newLine = NoNewLine;
+
+        // if the line end was not found we reached the end of the buffert.
+        //  if this is the last chunk it is okey. else the caller need to read more data
+        result.bEndOfDataReached = (TNewLinePolicy::FindLineEnd(pBegin, pEndOfData, pLineEnd, nChars, newLine) == false);
+        result.nCharsForNewLine = nChars;
+        result.newLineChars = newLine;
 
         result.pLine = reinterpret_cast<const BYTE*>(pBegin);
-        result.pNextLine = reinterpret_cast<const BYTE*>(pData);
-        result.length = (DWORD) ((pLineEnd - pBegin)*sizeof(T));
+        result.pNextLine = reinterpret_cast<const BYTE*>(pLineEnd + nChars);
+        result.length = (pLineEnd - pBegin)*sizeof(T);
         return result;
       }
 
@@ -104,14 +250,52 @@ namespace MZDR
   class LineParser
   {
     public:
+      // newLineStyle selects the newline policy. Use DataIdentifier::GetNewLineStyle() or LinesData::GetNewLineStyle()
+      //  Unknown (or NoNewLine) will accept LF, CRLF and CR mixed
+      LineParser(NewLine newLineStyle = Unknown)
+        : m_NewLineStyle(newLineStyle)
+      {
+      }
+
+      NewLine GetNewLineStyle() const { return m_NewLineStyle; }
+
+      // Call fn with the newline policy for this parser. Like fn(NewLinePolicyLF())
+      template<class F>
+      auto WithNewLinePolicy(F fn) const -> decltype(fn(NewLinePolicyAuto()))
+      {
+        switch (m_NewLineStyle)
+        {
+        case LF:
+          return fn(NewLinePolicyLF());
+        case CR:
+          return fn(NewLinePolicyCR());
+        case CRLF:
+          return fn(NewLinePolicyCRLF());
+        default:
+          return fn(NewLinePolicyAuto());
+        }
+      }
+
       ParseLineResult ParseLine(const char* pBegin, const char* pEndOfData)
       {
-        return LineParserT<char>::ParseLine(pBegin, pEndOfData);
+        return ParseLineT(pBegin, pEndOfData);
       }
       ParseLineResult ParseLine(const wchar_t* pBegin, const wchar_t* pEndOfData)
       {
-        return LineParserT<wchar_t>::ParseLine(pBegin, pEndOfData);
+        return ParseLineT(pBegin, pEndOfData);
+      }
+
+    protected:
+      template<class T>
+      ParseLineResult ParseLineT(const T* pBegin, const T* pEndOfData)
+      {
+        return WithNewLinePolicy([&](auto policy)
+        {
+          return LineParserT<T, decltype(policy)>::ParseLine(pBegin, pEndOfData);
+        });
       }
+
+      NewLine m_NewLineStyle;
   };
 
 }
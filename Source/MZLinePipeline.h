@@ -0,0 +1,298 @@
+#pragma once
+
+#include <vector>
+#include <map>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+#include <atomic>
+
+#include "MZLineReader.h"
+#include "MZDataWriter.h"
+#include "MZThreadPool.h"
+
+namespace MZDR
+{
+  //================================
+  // Blocking queue with a max size. Push blocks while the queue is full.
+  //  Close() wakes up all waiting threads. After Close() Push fails, and Pop fails once the queue is empty.
+  //================================
+
+  template<class TItem>
+  class BoundedQueue
+  {
+  public:
+    BoundedQueue(size_t nMaxItems)
+      : m_nMaxItems(nMaxItems > 0 ? nMaxItems : 1)
+    {
+    }
+
+    bool Push(TItem&& item)
+    {
+      std::unique_lock<std::mutex> lock(m_Mutex);
+      m_NotFull.wait(lock, [this] { return m_bClosed || m_Items.size() < m_nMaxItems; });
+      if (m_bClosed)
+        return false;
+
+      m_Items.push_back(std::move(item));
+      m_NotEmpty.notify_one();
+      return true;
+    }
+
+    bool Pop(TItem& item)
+    {
+      std::unique_lock<std::mutex> lock(m_Mutex);
+      m_NotEmpty.wait(lock, [this] { return m_bClosed || m_Items.empty() == false; });
+      if (m_Items.empty())
+        return false;
+
+      item = std::move(m_Items.front());
+      m_Items.pop_front();
+      m_NotFull.notify_one();
+      return true;
+    }
+
+    void Close()
+    {
+      std::lock_guard<std::mutex> lock(m_Mutex);
+      m_bClosed = true;
+      m_NotFull.notify_all();
+      m_NotEmpty.notify_all();
+    }
+
+  protected:
+    size_t m_nMaxItems;
+    std::deque<TItem> m_Items;
+    std::mutex m_Mutex;
+    std::condition_variable m_NotFull;
+    std::condition_variable m_NotEmpty;
+    bool m_bClosed = false;
+  };
+
+  //================================
+  // Line processing pipeline.  DataReader -> parse -> filter/map -> DataWriter
+  //  Reading, processing and writing run at the same time. Batches of lines are processed by a thread pool
+  //  and written in the same order as they are read. Max number of batches in memory is limited (SetMaxBatchesInFlight)
+  //================================
+
+  template<class T, class TLinesData>
+  class LinePipelineT : protected LineReaderT<T, TLinesData>
+  {
+  public:
+    typedef typename TLinesData::LineType Line;
+
+    // Return false to remove the line
+    typedef std::function<bool(const Line& line)> FilterFunc;
+
+    // Append output for the line to output. Default is to write the line data including newline
+    typedef std::function<void(const Line& line, std::vector<BYTE>& output)> MapFunc;
+
+    LinePipelineT& AddFilter(FilterFunc filter)
+    {
+      m_vFilters.push_back(filter);
+      return *this;
+    }
+
+    LinePipelineT& SetMap(MapFunc map)
+    {
+      m_Map = map;
+      return *this;
+    }
+
+    void SetBatchSize(size_t nBytes) { m_nBatchSize = nBytes; }
+    void SetMaxBatchesInFlight(size_t nBatches) { m_nMaxBatchesInFlight = nBatches > 0 ? nBatches : 1; }
+    void SetThreads(size_t nThreads) { m_nThreads = nThreads; }
+
+    // Run the pipeline. Returns when all data is written. Exception from any stage is rethrown here
+    void Run(MZDR::DataReader* pReader, MZDR::LineParser* pLineParser, MZDR::DataWriter* pWriter)
+    {
+      size_t nThreads = m_nThreads > 0 ? m_nThreads : ThreadPool::DefaultThreadCount();
+
+      BoundedQueue<InputBatch> inQueue(m_nMaxBatchesInFlight);
+      BoundedQueue<OutputBatch> outQueue(m_nMaxBatchesInFlight);
+      BoundedQueue<bool> inFlight(m_nMaxBatchesInFlight); // one item for each batch that is read but not yet written
+
+      std::exception_ptr spError;
+      std::mutex errorMutex;
+      auto setError = [&]()
+      {
+        {
+          std::lock_guard<std::mutex> lock(errorMutex);
+          if (spError == nullptr)
+            spError = std::current_exception();
+        }
+        inQueue.Close();
+        outQueue.Close();
+        inFlight.Close();
+      };
+
+      std::thread readerThread([&]()
+      {
+        try
+        {
+          ReadBatches(pReader, pLineParser, inQueue, inFlight);
+        }
+        catch (...)
+        {
+          setError();
+        }
+        inQueue.Close();
+      });
+
+      {
+        std::atomic<size_t> nActiveWorkers(nThreads);
+        ThreadPool pool(nThreads);
+        for (size_t i = 0; i < nThreads; i++)
+        {
+          pool.Submit([&]()
+          {
+            try
+            {
+              InputBatch in;
+              while (inQueue.Pop(in))
+              {
+                OutputBatch out;
+                out.nSeq = in.nSeq;
+                ProcessBatch(in.spLines, out.data);
+                in.spLines.reset();
+
+                if (outQueue.Push(std::move(out)) == false)
+                  break;
+              }
+            }
+            catch (...)
+            {
+              setError();
+            }
+
+            if (--nActiveWorkers == 0)
+              outQueue.Close();
+          });
+        }
+
+        // Write batches in sequence order
+        try
+        {
+          std::map<size_t, std::vector<BYTE>> pending;
+          size_t nNextSeq = 0;
+          OutputBatch out;
+          while (outQueue.Pop(out))
+          {
+            pending[out.nSeq] = std::move(out.data);
+
+            for (auto it = pending.find(nNextSeq); it != pending.end(); it = pending.find(nNextSeq))
+            {
+              if (it->second.empty() == false)
+                pWriter->WriteData(it->second.data(), it->second.size());
+
+              pending.erase(it);
+              nNextSeq++;
+
+              bool bToken;
+              inFlight.Pop(bToken);
+            }
+          }
+        }
+        catch (...)
+        {
+          setError();
+        }
+      }
+
+      readerThread.join();
+
+      if (spError)
+        std::rethrow_exception(spError);
+    }
+
+  protected:
+    struct InputBatch
+    {
+      size_t nSeq;
+      std::shared_ptr<TLinesData> spLines;
+    };
+
+    struct OutputBatch
+    {
+      size_t nSeq;
+      std::vector<BYTE> data;
+    };
+
+    void ReadBatches(MZDR::DataReader* pReader, MZDR::LineParser* pLineParser, BoundedQueue<InputBatch>& inQueue, BoundedQueue<bool>& inFlight)
+    {
+      size_t nLeftToRead = pReader->TotalDataSize();
+      size_t nSeq = 0;
+      std::vector<BYTE> vCarry; // incomplete line from previous batch
+
+      while (nLeftToRead)
+      {
+        // Wait until there is room for one more batch
+        if (inFlight.Push(true) == false)
+          return;
+
+        InputBatch batch;
+        batch.nSeq = nSeq++;
+        batch.spLines = std::make_shared<TLinesData>();
+
+        size_t nCarry = vCarry.size();
+        size_t nBufferSize = nCarry + m_nBatchSize;
+        BYTE* pBuffer = batch.spLines->AllocateBuffer(nBufferSize);
+        if (nCarry)
+          CopyMemory(pBuffer, vCarry.data(), nCarry);
+
+        size_t nBytesRead = 0;
+        pReader->ReadDataThrow(pBuffer + nCarry, m_nBatchSize, &nBytesRead);
+        nLeftToRead -= nBytesRead;
+        bool bLastChunk = (nLeftToRead == 0 || nBytesRead == 0);
+
+        const BYTE* pEndOfData = pBuffer + nCarry + nBytesRead;
+        auto result = this->ParseBuffert(batch.spLines, pLineParser, pBuffer, pEndOfData, bLastChunk);
+
+        vCarry.clear();
+        if (result.bEndOfDataReached && bLastChunk == false && result.pLine)
+          vCarry.assign(result.pLine, pEndOfData);
+
+        if (inQueue.Push(std::move(batch)) == false)
+          return;
+
+        if (bLastChunk)
+          break;
+      }
+    }
+
+    void ProcessBatch(std::shared_ptr<TLinesData>& spLines, std::vector<BYTE>& output)
+    {
+      for (auto&& line : spLines->GetLines())
+      {
+        bool bKeep = true;
+        for (auto&& filter : m_vFilters)
+        {
+          if (filter(line) == false)
+          {
+            bKeep = false;
+            break;
+          }
+        }
+
+        if (bKeep == false)
+          continue;
+
+        if (m_Map)
+          m_Map(line, output);
+        else
+          output.insert(output.end(), line.GetLineData(), line.GetLineData() + line.GetLineDataLength());
+      }
+    }
+
+    std::vector<FilterFunc> m_vFilters;
+    MapFunc m_Map;
+
+    size_t m_nBatchSize = 1024 * 1024;
+    size_t m_nMaxBatchesInFlight = 16;
+    size_t m_nThreads = 0;
+  };
+
+}
@@ -1,26 +1,50 @@
 #pragma once
 #include <vector>
 #include <memory>
+#include <functional>
+#include <cassert>
+#include <stdint.h>
 
-#include "../../MZDataReader/Source/MZLineReader.h"
-#include "../../MZDataReader/Source/MZLineParser.h"
+#include "MZLineReader.h"
+#include "MZLineParser.h"
+#include "MZDataReader.h"
+#include "MZThreadPool.h"
+#include "MZMemoryBudget.h"
+#include "MZFileBackedLinesData.h"
 
 
 namespace MZDR
 {
-  class DataReader;
-  
   template<class T, class TLinesData>
   class LineReaderT
   {
     public:
 
+      // Count newlines first and allocate the line index once with the exact size.
+      //  Avoid reallocation of the line index, but data is scanned twice.
+      void SetExactSizeIndexing(bool bExactSize) { m_bExactSizeIndexing = bExactSize; }
+
+      // fn(const ParseLineResult& line) is called for each line in order while the data is parsed. Like FieldTokenizerT::AddLine.
+      //  Not supported by ReadLinesFromDataReaders/ReadLinesFromFiles since sources are parsed at the same time
+      typedef std::function<void(const MZDR::ParseLineResult& line)> LineCallback;
+      void SetLineCallback(LineCallback fn) { m_fnLineCallback = std::move(fn); }
+
+      // fn(TLinesData& sealed) is called with each buffer and its lines as soon as all lines in the buffer are parsed.
+      //  The reader drops sealed after the call. Take the buffers with DetachBuffers. ReadLinesFromDataReader then returns an empty LinesData.
+      //  Used by CompressedLinesDataT to compress while reading. Only supported by ReadLinesFromDataReader without exact size indexing
+      typedef std::function<void(TLinesData& sealed)> SealedBufferCallback;
+      void SetSealedBufferCallback(SealedBufferCallback fn) { m_fnSealedBuffer = std::move(fn); }
+
       std::shared_ptr<TLinesData> ReadLinesFromBuffert(const BYTE* pData, size_t buffLen, MZDR::LineParser* pLineParser)
       {
         auto pLinesData = std::make_shared<TLinesData>();
-        pLinesData->ReserveLines(buffLen / 60); // Assumes 60 char average per line
+        if (m_bExactSizeIndexing)
+          pLinesData->ReserveLines(CountNewLines(pLineParser, pData, pData + buffLen) + 1);
+        else
+          pLinesData->ReserveLines(buffLen / 60); // Assumes 60 char average per line
 
-        auto pBuffer = pLinesData->AllocateBuffer(m_ChunkSize);
+        auto pBuffer = pLinesData->AllocateBuffer(buffLen);
+        ThrowIfOverBudget();
         CopyMemory(pBuffer, pData, buffLen);
 
 
@@ -30,41 +54,310 @@ namespace MZDR
         return pLinesData;
       }
 
+      // Throws ERROR_NOT_ENOUGH_MEMORY if MemoryBudget::Global() is exceeded while reading. Use ReadLinesFromDataReaderWithBudget to fall back to offsets
       std::shared_ptr<TLinesData> ReadLinesFromDataReader(MZDR::DataReader* pReader, MZDR::LineParser* pLineParser, MZDR::ContentFormat format = MZDR::ContentUnknown)
+      {
+        if (m_bExactSizeIndexing)
+        {
+          if (m_fnSealedBuffer)
+            throw MZDR::MZDataReaderException(ERROR_NOT_SUPPORTED, "Sealed buffer callback is not supported with exact size indexing");
+          return ReadLinesFromDataReaderExactSize(pReader, pLineParser, format);
+        }
+
+        return ReadLinesChunked(pReader, pLineParser, format, nullptr);
+      }
+
+      // Result of ReadLinesFromDataReaderWithBudget. Only one of them is set
+      struct BudgetedResult
+      {
+        std::shared_ptr<TLinesData> spLinesData;
+        std::shared_ptr<MZDR::FileBackedLinesDataT<T, TLinesData>> spFileBacked;
+      };
+
+      // Read in to memory if it fits in MemoryBudget::Global(). Else only the line offsets are kept and lines are read from spReader when used.
+      //  If the budget is exceeded while reading, lines read so far are kept as offsets and the rest is scanned offset only.
+      //  spReader MUST support ReadDataAtThrow
+      BudgetedResult ReadLinesFromDataReaderWithBudget(std::shared_ptr<MZDR::DataReader> spReader, MZDR::LineParser* pLineParser, MZDR::ContentFormat format = MZDR::ContentUnknown)
+      {
+        if (m_fnSealedBuffer)
+          throw MZDR::MZDataReaderException(ERROR_NOT_SUPPORTED, "Sealed buffer callback is not supported when reading with a budget");
+
+        BudgetedResult result;
+
+        size_t nDataSize = spReader->TotalDataSize();
+        size_t nEstimate = nDataSize + (nDataSize / 60) * sizeof(typename TLinesData::LineType);
+        if (MZDR::MemoryBudget::Global().WouldExceed(nEstimate) == false)
+        {
+          StoppedRead stopped;
+          result.spLinesData = ReadLinesChunked(spReader.get(), pLineParser, format, &stopped);
+          if (result.spLinesData)
+            return result;
+
+          result.spFileBacked = std::make_shared<MZDR::FileBackedLinesDataT<T, TLinesData>>(spReader, pLineParser, *stopped.spLinesData, stopped.vBufferOffsets, stopped.nScanOffset, format);
+          return result;
+        }
+
+        result.spFileBacked = std::make_shared<MZDR::FileBackedLinesDataT<T, TLinesData>>(spReader, pLineParser, format);
+        return result;
+      }
+
+      // Read multiple sources concurrently and merge them in input order. nMaxThreads = 0 will use one thread per core
+      // Use GetSourceBoundaries() on the result to find the first line of each source
+      std::shared_ptr<TLinesData> ReadLinesFromDataReaders(const std::vector<MZDR::DataReader*>& vReaders, MZDR::LineParser* pLineParser, MZDR::ContentFormat format = MZDR::ContentUnknown, size_t nMaxThreads = 0)
+      {
+        std::vector<std::function<std::shared_ptr<TLinesData>()>> vJobs;
+        for (auto pReader : vReaders)
+        {
+          vJobs.push_back([this, pReader, pLineParser, format] { return ReadLinesFromDataReader(pReader, pLineParser, format); });
+        }
+
+        return ReadAndMerge(vJobs, format, nMaxThreads);
+      }
+
+      // Same as ReadLinesFromDataReaders. But files are opened by the worker threads. So only nMaxThreads files are open at the same time
+      std::shared_ptr<TLinesData> ReadLinesFromFiles(const std::vector<STLString>& vFilenames, MZDR::LineParser* pLineParser, MZDR::ContentFormat format = MZDR::ContentUnknown, size_t nMaxThreads = 0)
+      {
+        std::vector<std::function<std::shared_ptr<TLinesData>()>> vJobs;
+        for (auto&& filename : vFilenames)
+        {
+          vJobs.push_back([this, filename, pLineParser, format]
+          {
+            MZDR::FileDataReader reader(filename);
+            return ReadLinesFromDataReader(&reader, pLineParser, format);
+          });
+        }
+
+        return ReadAndMerge(vJobs, format, nMaxThreads);
+      }
+
+    protected:
+      // State of a read stopped by the memory budget. Buffer i of spLinesData starts at vBufferOffsets[i] in the data.
+      //  nScanOffset is the offset of the first line that is not parsed
+      struct StoppedRead
+      {
+        std::shared_ptr<TLinesData> spLinesData;
+        std::vector<uint64_t> vBufferOffsets;
+        uint64_t nScanOffset = 0;
+      };
+
+      // MemoryBudget::Global() is checked after each chunk by all paths. Loading is stopped if it is exceeded
+      static void ThrowIfOverBudget()
+      {
+        if (MZDR::MemoryBudget::Global().IsExceeded())
+          throw MZDR::MZDataReaderException(ERROR_NOT_ENOUGH_MEMORY, "Memory budget exceeded while reading lines");
+      }
+
+      // Read chunk by chunk. Incomplete line at the end of a chunk is moved to the next buffer.
+      //  Throws if MemoryBudget::Global() is exceeded. If pStopped is set it gets what is read so far and nullptr is returned instead
+      std::shared_ptr<TLinesData> ReadLinesChunked(MZDR::DataReader* pReader, MZDR::LineParser* pLineParser, MZDR::ContentFormat format, StoppedRead* pStopped)
       {
         size_t nLeftToRead = pReader->TotalDataSize();
+        uint64_t nReadOffset = 0;
 
+        // With a sealed buffer callback each buffer gets its own LinesData
         auto pLinesData = std::make_shared<TLinesData>();
-        pLinesData->ReserveLines(nLeftToRead / 60); // Assumes 60 char average per line
+        pLinesData->ReserveLines((m_fnSealedBuffer ? m_ChunkSize : nLeftToRead) / 60); // Assumes 60 char average per line
         pLinesData->ContentFormat(format);
 
-        auto pBuffer = pLinesData->AllocateBuffer(m_ChunkSize);
-        DWORD nOffset = 0;
+        size_t nBufferSize = m_ChunkSize;
+        auto pBuffer = pLinesData->AllocateBuffer(nBufferSize);
+        size_t nOffset = 0;
+        if (pStopped)
+          pStopped->vBufferOffsets.push_back(0);
 
         while (nLeftToRead)
         {
-          DWORD dwBytesRead = 0;
+          size_t nBytesRead = 0;
 
-          pReader->ReadDataThrow(pBuffer + nOffset, m_ChunkSize - nOffset, &dwBytesRead);
+          pReader->ReadDataThrow(pBuffer + nOffset, nBufferSize - nOffset, &nBytesRead);
 
-          nLeftToRead -= dwBytesRead;
+          nLeftToRead -= nBytesRead;
+          nReadOffset += nBytesRead;
           bool bLastChunk = nLeftToRead <= 0;
 
-          auto result = ParseBuffert(pLinesData, pLineParser, pBuffer, pBuffer + nOffset + dwBytesRead, bLastChunk);
+          const BYTE* pEndOfData = pBuffer + nOffset + nBytesRead;
+          auto result = ParseBuffert(pLinesData, pLineParser, pBuffer, pEndOfData, bLastChunk);
           if (result.bEndOfDataReached && bLastChunk == false)
           {
-            pBuffer = pLinesData->AllocateBuffer(m_ChunkSize);
-            CopyMemory(pBuffer, result.pLine, result.length);
-            nOffset = result.length;
+            // Move the incomplete line to the next buffer. It can end with a CR that is part of a CRLF split between chunks
+            size_t nCarry = result.pLine ? static_cast<size_t>(pEndOfData - result.pLine) : 0;
+
+            if (MZDR::MemoryBudget::Global().IsExceeded())
+            {
+              if (pStopped == nullptr)
+                ThrowIfOverBudget();
+
+              pStopped->spLinesData = pLinesData;
+              pStopped->nScanOffset = nReadOffset - nCarry;
+              return nullptr;
+            }
+
+            std::shared_ptr<TLinesData> spSealed;
+            if (m_fnSealedBuffer)
+            {
+              spSealed = pLinesData;
+              pLinesData = std::make_shared<TLinesData>();
+              pLinesData->ReserveLines(m_ChunkSize / 60);
+              pLinesData->ContentFormat(format);
+            }
+
+            // Line is larger then the chunk. Grow the buffer so we can read more of it
+            nBufferSize = (nCarry * 2 > m_ChunkSize) ? nCarry * 2 : m_ChunkSize;
+            pBuffer = pLinesData->AllocateBuffer(nBufferSize);
+            if (nCarry)
+              CopyMemory(pBuffer, result.pLine, nCarry);
+            nOffset = nCarry;
+            if (pStopped)
+              pStopped->vBufferOffsets.push_back(nReadOffset - nCarry);
+
+            // Carry is copied. Nothing points in to the sealed buffer
+            if (spSealed)
+              m_fnSealedBuffer(*spSealed);
           }
 
         } // while read chunks
 
+        if (m_fnSealedBuffer)
+        {
+          m_fnSealedBuffer(*pLinesData);
+          pLinesData = std::make_shared<TLinesData>();
+          pLinesData->ContentFormat(format);
+        }
+
         return pLinesData;
       }
 
-    protected:
+      // First pass read all data in to buffers and count newlines. Each buffer is cut after the last complete line.
+      // Second pass parse the buffers in to the line index that now have the exact size
+      std::shared_ptr<TLinesData> ReadLinesFromDataReaderExactSize(MZDR::DataReader* pReader, MZDR::LineParser* pLineParser, MZDR::ContentFormat format)
+      {
+        size_t nLeftToRead = pReader->TotalDataSize();
+
+        auto pLinesData = std::make_shared<TLinesData>();
+        pLinesData->ContentFormat(format);
+
+        struct Region
+        {
+          const BYTE* pBegin;
+          const BYTE* pEnd;
+        };
+        std::vector<Region> vRegions;
+        size_t nNewLines = 0;
+
+        size_t nBufferSize = m_ChunkSize;
+        auto pBuffer = pLinesData->AllocateBuffer(nBufferSize);
+        size_t nOffset = 0;
+
+        while (nLeftToRead)
+        {
+          size_t nBytesRead = 0;
+          pReader->ReadDataThrow(pBuffer + nOffset, nBufferSize - nOffset, &nBytesRead);
+          nLeftToRead -= nBytesRead;
+
+          const BYTE* pEndOfData = pBuffer + nOffset + nBytesRead;
+          if (nLeftToRead == 0 || nBytesRead == 0)
+          {
+            nNewLines += CountNewLines(pLineParser, pBuffer, pEndOfData);
+            vRegions.push_back({ pBuffer, pEndOfData });
+            break;
+          }
+
+          const BYTE* pSplit = FindLastLineEnd(pLineParser, pBuffer, pEndOfData);
+          nNewLines += CountNewLines(pLineParser, pBuffer, pSplit);
+          if (pSplit > pBuffer)
+            vRegions.push_back({ pBuffer, pSplit });
+
+          ThrowIfOverBudget();
+
+          // Move the incomplete line to the next buffer. Grow the buffer if line is larger then the chunk
+          size_t nCarry = pEndOfData - pSplit;
+          nBufferSize = (nCarry * 2 > m_ChunkSize) ? nCarry * 2 : m_ChunkSize;
+          pBuffer = pLinesData->AllocateBuffer(nBufferSize);
+          CopyMemory(pBuffer, pSplit, nCarry);
+          nOffset = nCarry;
+        }
+
+        pLinesData->ReserveLines(nNewLines + 1);
+        ThrowIfOverBudget();
+
+        for (auto&& region : vRegions)
+          ParseBuffert(pLinesData, pLineParser, region.pBegin, region.pEnd, true);
+
+        return pLinesData;
+      }
+
+      size_t CountNewLines(MZDR::LineParser* pLineParser, const BYTE* pBegin, const BYTE* pEnd)
+      {
+        const T* pData = reinterpret_cast<const T*>(pBegin);
+        const T* pEndOfData = reinterpret_cast<const T*>(pBegin + ((pEnd - pBegin) / sizeof(T)) * sizeof(T));
+
+        return pLineParser->WithNewLinePolicy([&](auto policy)
+        {
+          return decltype(policy)::CountNewLines(pData, pEndOfData);
+        });
+      }
+
+      const BYTE* FindLastLineEnd(MZDR::LineParser* pLineParser, const BYTE* pBegin, const BYTE* pEnd)
+      {
+        const T* pData = reinterpret_cast<const T*>(pBegin);
+        const T* pEndOfData = reinterpret_cast<const T*>(pBegin + ((pEnd - pBegin) / sizeof(T)) * sizeof(T));
+
+        return pLineParser->WithNewLinePolicy([&](auto policy)
+        {
+          return reinterpret_cast<const BYTE*>(decltype(policy)::FindLastLineEnd(pData, pEndOfData));
+        });
+      }
+
+      std::shared_ptr<TLinesData> ReadAndMerge(std::vector<std::function<std::shared_ptr<TLinesData>()>>& vJobs, MZDR::ContentFormat format, size_t nMaxThreads)
+      {
+        if (m_fnLineCallback || m_fnSealedBuffer)
+          throw MZDR::MZDataReaderException(ERROR_NOT_SUPPORTED, "Line and sealed buffer callbacks are not supported when reading multiple sources");
+
+        if (nMaxThreads == 0)
+          nMaxThreads = MZDR::ThreadPool::DefaultThreadCount();
+        if (nMaxThreads > vJobs.size())
+          nMaxThreads = vJobs.size();
+
+        std::vector<std::shared_ptr<TLinesData>> vResults;
+        {
+          MZDR::ThreadPool pool(nMaxThreads);
+          std::vector<std::future<std::shared_ptr<TLinesData>>> vFutures;
+          for (auto&& job : vJobs)
+            vFutures.push_back(pool.Submit(job));
+
+          // get() rethrows exception from the worker thread
+          for (auto&& future : vFutures)
+            vResults.push_back(future.get());
+        }
+
+        size_t nTotalLines = 0;
+        for (auto&& spResult : vResults)
+          nTotalLines += spResult->NumLines();
+
+        auto pLinesData = std::make_shared<TLinesData>();
+        pLinesData->ReserveLines(nTotalLines);
+        pLinesData->ContentFormat(format);
+
+        for (auto&& spResult : vResults)
+        {
+          pLinesData->Append(std::move(*spResult));
+          spResult.reset();
+        }
+
+        return pLinesData;
+      }
+
+      // Newline policy is selected once per buffer. Not for every line
       MZDR::ParseLineResult ParseBuffert(std::shared_ptr<TLinesData>& spLinesData, MZDR::LineParser* pLineParser, const BYTE* pBuffer, const BYTE* pEnd, bool bLastChunk)
+      {
+        return pLineParser->WithNewLinePolicy([&](auto policy)
+        {
+          return this->template ParseBuffertT<MZDR::LineParserT<T, decltype(policy)>>(spLinesData, pBuffer, pEnd, bLastChunk);
+        });
+      }
+
+      template<class TParser>
+      MZDR::ParseLineResult ParseBuffertT(std::shared_ptr<TLinesData>& spLinesData, const BYTE* pBuffer, const BYTE* pEnd, bool bLastChunk)
       {
         const BYTE* pLineStart = pBuffer;
         const BYTE* pEndOfData = pEnd;
@@ -74,7 +367,7 @@ namespace MZDR
 
         while (pLineStart)
         {
-          parseResult = ParseLine(pLineParser, pLineStart, pEndOfData);
+          parseResult = TParser::ParseLine(reinterpret_cast<const T*>(pLineStart), reinterpret_cast<const T*>(pEndOfData));
           if (parseResult.pLine)
           {
             if (parseResult.bEndOfDataReached && bLastChunk == false)
@@ -85,6 +378,8 @@ namespace MZDR
             else
             {
               spLinesData->InsertLine(parseResult.pLine, parseResult.length, parseResult.newLineChars, parseResult.nCharsForNewLine*sizeof(T));
+              if (m_fnLineCallback)
+                m_fnLineCallback(parseResult);
               pLineStart = parseResult.pNextLine;
             }
           }
@@ -97,14 +392,12 @@ namespace MZDR
         return parseResult;
 
       }
-     
-      MZDR::ParseLineResult ParseLine(MZDR::LineParser* pLineParser, const BYTE* pLineStart, const BYTE* pEndOfData)
-      {
-        return pLineParser->ParseLine(reinterpret_cast<const T*>(pLineStart), reinterpret_cast<const T*>(pEndOfData));
-      }
 
       STLString m_strFilename;
-      DWORD m_ChunkSize = 32*1024; // 256kb
+      size_t m_ChunkSize = 32*1024; // 256kb
+      bool m_bExactSizeIndexing = false;
+      LineCallback m_fnLineCallback;
+      SealedBufferCallback m_fnSealedBuffer;
   };
 
 }
@@ -0,0 +1,407 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <random>
+#include <type_traits>
+
+#include "MZDataReader.h"
+#include "MZLineParser.h"
+#include "MZThreadPool.h"
+
+namespace MZDR
+{
+  // Line length statistics. Length is in characters and do not include the newline
+  struct LineLengthStats
+  {
+    LineLengthStats(DWORD bucketWidth = 16, size_t nBuckets = 64)
+      : nBucketWidth(bucketWidth > 0 ? bucketWidth : 1)
+      , vBuckets(nBuckets > 0 ? nBuckets : 1, 0)
+    {
+    }
+
+    void Add(size_t nLength)
+    {
+      if (nLines == 0 || nLength < nMinLength)
+        nMinLength = nLength;
+      if (nLength > nMaxLength)
+        nMaxLength = nLength;
+
+      nLines++;
+      nTotalLength += nLength;
+
+      size_t nBucket = nLength / nBucketWidth;
+      if (nBucket >= vBuckets.size())
+        nBucket = vBuckets.size() - 1;
+      vBuckets[nBucket]++;
+    }
+
+    void Merge(const LineLengthStats& other)
+    {
+      if (other.nLines == 0)
+        return;
+
+      if (nLines == 0 || other.nMinLength < nMinLength)
+        nMinLength = other.nMinLength;
+      if (other.nMaxLength > nMaxLength)
+        nMaxLength = other.nMaxLength;
+
+      nLines += other.nLines;
+      nTotalLength += other.nTotalLength;
+      for (size_t i = 0; i < vBuckets.size() && i < other.vBuckets.size(); i++)
+        vBuckets[i] += other.vBuckets[i];
+    }
+
+    size_t nLines = 0;
+    size_t nMinLength = 0;
+    size_t nMaxLength = 0;
+    size_t nTotalLength = 0;
+
+    DWORD nBucketWidth;
+    std::vector<size_t> vBuckets; // Last bucket also count all longer lines
+  };
+
+  //================================
+  // Streaming operations on lines. Lines are never stored in a LinesData.
+  //  Only one chunk (or the longest line) is kept in memory when reading from a DataReader
+  // T MUST be char or wchar_t
+  //================================
+
+  template<class T>
+  class LineStreamT
+  {
+  public:
+    LineStreamT(MZDR::LineParser* pLineParser)
+      : m_pLineParser(pLineParser)
+    {
+    }
+
+    void SetChunkSize(size_t nChunkSize) { m_nChunkSize = nChunkSize; }
+
+    // fn(const ParseLineResult& line) is called for each line. Return false to stop reading
+    template<class F>
+    void ForEachLine(MZDR::DataReader* pReader, F fn)
+    {
+      m_pLineParser->WithNewLinePolicy([&](auto policy) { ForEachLineT<decltype(policy)>(pReader, fn); });
+    }
+
+    size_t CountLines(MZDR::DataReader* pReader)
+    {
+      return m_pLineParser->WithNewLinePolicy([&](auto policy) { return CountLinesT<decltype(policy)>(pReader); });
+    }
+
+    // Count lines in memory (like a mapped file). nThreads = 0 will use one thread per core
+    size_t CountLines(const BYTE* pData, size_t len, size_t nThreads = 0)
+    {
+      return m_pLineParser->WithNewLinePolicy([&](auto policy) { return CountLinesT<decltype(policy)>(pData, len, nThreads); });
+    }
+
+    // First nLines lines. Stops reading when all lines are found
+    template<class TLinesData>
+    std::shared_ptr<TLinesData> Head(MZDR::DataReader* pReader, size_t nLines)
+    {
+      auto pLinesData = std::make_shared<TLinesData>();
+      if (nLines == 0)
+        return pLinesData;
+
+      pLinesData->ReserveLines(nLines);
+
+      BYTE* pBuffer = nullptr;
+      size_t nAvail = 0;
+      ForEachLine(pReader, [&](const ParseLineResult& line)
+      {
+        size_t nNewLineBytes = line.nCharsForNewLine * sizeof(T);
+        size_t nBytes = line.length + nNewLineBytes;
+        if (nBytes > nAvail)
+        {
+          nAvail = (nBytes > m_nChunkSize) ? nBytes : m_nChunkSize;
+          pBuffer = pLinesData->AllocateBuffer(nAvail);
+        }
+
+        CopyMemory(pBuffer, line.pLine, nBytes);
+        pLinesData->InsertLine(pBuffer, line.length, line.newLineChars, static_cast<BYTE>(nNewLineBytes));
+        pBuffer += nBytes;
+        nAvail -= nBytes;
+
+        return pLinesData->NumLines() < nLines;
+      });
+
+      return pLinesData;
+    }
+
+    // Uniform random sample of nSamples lines. (Reservoir sampling) Newline is not included
+    std::vector<std::basic_string<T>> ReservoirSample(MZDR::DataReader* pReader, size_t nSamples, unsigned int seed = 0)
+    {
+      std::vector<std::basic_string<T>> vSamples;
+      if (nSamples == 0)
+        return vSamples;
+
+      std::mt19937_64 rng(seed);
+      size_t nSeen = 0;
+
+      ForEachLine(pReader, [&](const ParseLineResult& line)
+      {
+        const T* pLine = reinterpret_cast<const T*>(line.pLine);
+        size_t nChars = line.length / sizeof(T);
+
+        if (nSeen < nSamples)
+        {
+          vSamples.emplace_back(pLine, nChars);
+        }
+        else
+        {
+          size_t j = std::uniform_int_distribution<size_t>(0, nSeen)(rng);
+          if (j < nSamples)
+            vSamples[j].assign(pLine, nChars);
+        }
+
+        nSeen++;
+        return true;
+      });
+
+      return vSamples;
+    }
+
+    LineLengthStats LengthHistogram(MZDR::DataReader* pReader, DWORD nBucketWidth = 16, size_t nBuckets = 64)
+    {
+      LineLengthStats stats(nBucketWidth, nBuckets);
+      ForEachLine(pReader, [&](const ParseLineResult& line)
+      {
+        stats.Add(line.length / sizeof(T));
+        return true;
+      });
+      return stats;
+    }
+
+    // Length histogram of lines in memory (like a mapped file). nThreads = 0 will use one thread per core
+    LineLengthStats LengthHistogram(const BYTE* pData, size_t len, DWORD nBucketWidth = 16, size_t nBuckets = 64, size_t nThreads = 0)
+    {
+      return m_pLineParser->WithNewLinePolicy([&](auto policy) { return LengthHistogramT<decltype(policy)>(pData, len, nBucketWidth, nBuckets, nThreads); });
+    }
+
+  protected:
+    template<class TPolicy, class F>
+    void ForEachLineT(MZDR::DataReader* pReader, F& fn)
+    {
+      typedef LineParserT<T, TPolicy> Parser;
+
+      std::vector<BYTE> vBuffer(m_nChunkSize);
+      size_t nLeftToRead = pReader->TotalDataSize();
+      size_t nOffset = 0;
+
+      while (nLeftToRead)
+      {
+        size_t nBytesRead = 0;
+        pReader->ReadDataThrow(vBuffer.data() + nOffset, vBuffer.size() - nOffset, &nBytesRead);
+        nLeftToRead -= nBytesRead;
+        bool bLastChunk = (nLeftToRead == 0 || nBytesRead == 0);
+
+        const BYTE* pEndOfData = vBuffer.data() + nOffset + nBytesRead;
+        const BYTE* pLineStart = vBuffer.data();
+        for (;;)
+        {
+          auto result = Parser::ParseLine(reinterpret_cast<const T*>(pLineStart), reinterpret_cast<const T*>(pEndOfData));
+          if (result.pLine == nullptr)
+          {
+            pLineStart = pEndOfData;
+            break;
+          }
+
+          if (result.bEndOfDataReached && bLastChunk == false)
+            break; // incomplete line. read more
+
+          if (fn(result) == false)
+            return;
+
+          pLineStart = result.pNextLine;
+        }
+
+        if (bLastChunk)
+          break;
+
+        // Move incomplete line to start of buffer. Grow buffer if line is larger then the chunk
+        size_t nCarry = pEndOfData - pLineStart;
+        MoveMemory(vBuffer.data(), pLineStart, nCarry);
+        nOffset = nCarry;
+        if (nCarry * 2 > vBuffer.size())
+          vBuffer.resize(nCarry * 2);
+      }
+    }
+
+    template<class TPolicy>
+    static bool EndsWithNewLine(const T* pData, const T* pEnd, bool bPrevEndsWithCR)
+    {
+      const T LF = 0x0a;
+      const T CR = 0x0d;
+
+      T last = *(pEnd - 1);
+      if (std::is_same<TPolicy, NewLinePolicyCRLF>::value)
+        return last == LF && ((pEnd - pData >= 2) ? *(pEnd - 2) == CR : bPrevEndsWithCR);
+      if (std::is_same<TPolicy, NewLinePolicyLF>::value)
+        return last == LF;
+      if (std::is_same<TPolicy, NewLinePolicyCR>::value)
+        return last == CR;
+
+      return last == LF || last == CR;
+    }
+
+    // Count newlines in each chunk. Only CRLF split between two chunks need special handling
+    template<class TPolicy>
+    size_t CountLinesT(MZDR::DataReader* pReader)
+    {
+      const T LF = 0x0a;
+      const T CR = 0x0d;
+
+      size_t nBufferSize = (m_nChunkSize / sizeof(T)) * sizeof(T);
+      std::vector<BYTE> vBuffer(nBufferSize);
+      size_t nLeftToRead = pReader->TotalDataSize();
+
+      size_t nCount = 0;
+      bool bPrevEndsWithCR = false;
+      bool bEndsWithNewLine = true;
+
+      while (nLeftToRead)
+      {
+        size_t nBytesRead = 0;
+        pReader->ReadDataThrow(vBuffer.data(), nBufferSize, &nBytesRead);
+        nLeftToRead -= nBytesRead;
+
+        const T* pData = reinterpret_cast<const T*>(vBuffer.data());
+        const T* pEnd = pData + nBytesRead / sizeof(T);
+        if (pData == pEnd)
+          break;
+
+        nCount += TPolicy::CountNewLines(pData, pEnd);
+        if (bPrevEndsWithCR && *pData == LF)
+        {
+          if (std::is_same<TPolicy, NewLinePolicyAuto>::value)
+            nCount--; // CR and LF was counted as two newlines
+          else if (std::is_same<TPolicy, NewLinePolicyCRLF>::value)
+            nCount++;
+        }
+
+        bEndsWithNewLine = EndsWithNewLine<TPolicy>(pData, pEnd, bPrevEndsWithCR);
+        bPrevEndsWithCR = *(pEnd - 1) == CR;
+      }
+
+      if (bEndsWithNewLine == false)
+        nCount++; // last line without newline
+
+      return nCount;
+    }
+
+    // Split data in parts that start at the beginning of a line
+    template<class TPolicy>
+    static std::vector<const T*> SplitAtLines(const T* pData, const T* pEnd, size_t nParts)
+    {
+      std::vector<const T*> vSplit(nParts + 1, pData);
+      vSplit[nParts] = pEnd;
+
+      for (size_t i = 1; i < nParts; i++)
+      {
+        const T* p = pData + ((pEnd - pData) * i) / nParts;
+        if (p <= vSplit[i - 1])
+        {
+          vSplit[i] = vSplit[i - 1];
+          continue;
+        }
+
+        // Start parsing at character before. If that is a newline, p is already a line start
+        auto result = LineParserT<T, TPolicy>::ParseLine(p - 1, pEnd);
+        vSplit[i] = reinterpret_cast<const T*>(result.pNextLine);
+      }
+      return vSplit;
+    }
+
+    static size_t PartsForData(size_t len, size_t& nThreads)
+    {
+      const size_t nMinPartSize = 1024 * 1024;
+
+      if (nThreads == 0)
+        nThreads = ThreadPool::DefaultThreadCount();
+
+      size_t nParts = nThreads;
+      if (nParts > len / nMinPartSize)
+        nParts = len / nMinPartSize;
+      return nParts > 1 ? nParts : 1;
+    }
+
+    template<class TPolicy>
+    size_t CountLinesT(const BYTE* pBuffer, size_t len, size_t nThreads)
+    {
+      const T* pData = reinterpret_cast<const T*>(pBuffer);
+      const T* pEnd = pData + len / sizeof(T);
+      if (pData == pEnd)
+        return 0;
+
+      size_t nParts = PartsForData(len, nThreads);
+      auto vSplit = SplitAtLines<TPolicy>(pData, pEnd, nParts);
+
+      std::vector<size_t> vCounts(nParts, 0);
+      auto countPart = [&](size_t i) { vCounts[i] = TPolicy::CountNewLines(vSplit[i], vSplit[i + 1]); };
+
+      if (nParts == 1)
+      {
+        countPart(0);
+      }
+      else
+      {
+        ThreadPool pool(nParts);
+        pool.ParallelFor(nParts, countPart);
+      }
+
+      size_t nCount = 0;
+      for (auto n : vCounts)
+        nCount += n;
+
+      if (EndsWithNewLine<TPolicy>(pData, pEnd, false) == false)
+        nCount++;
+
+      return nCount;
+    }
+
+    template<class TPolicy>
+    LineLengthStats LengthHistogramT(const BYTE* pBuffer, size_t len, DWORD nBucketWidth, size_t nBuckets, size_t nThreads)
+    {
+      typedef LineParserT<T, TPolicy> Parser;
+
+      const T* pData = reinterpret_cast<const T*>(pBuffer);
+      const T* pEnd = pData + len / sizeof(T);
+
+      size_t nParts = PartsForData(len, nThreads);
+      auto vSplit = SplitAtLines<TPolicy>(pData, pEnd, nParts);
+
+      std::vector<LineLengthStats> vStats(nParts, LineLengthStats(nBucketWidth, nBuckets));
+      auto statsForPart = [&](size_t i)
+      {
+        const T* pLine = vSplit[i];
+        while (pLine < vSplit[i + 1])
+        {
+          auto result = Parser::ParseLine(pLine, vSplit[i + 1]);
+          vStats[i].Add(result.length / sizeof(T));
+          pLine = reinterpret_cast<const T*>(result.pNextLine);
+        }
+      };
+
+      if (nParts == 1)
+      {
+        statsForPart(0);
+      }
+      else
+      {
+        ThreadPool pool(nParts);
+        pool.ParallelFor(nParts, statsForPart);
+      }
+
+      LineLengthStats stats(nBucketWidth, nBuckets);
+      for (auto&& partStats : vStats)
+        stats.Merge(partStats);
+
+      return stats;
+    }
+
+    MZDR::LineParser* m_pLineParser;
+    size_t m_nChunkSize = 256*1024;
+  };
+
+}
@@ -2,20 +2,23 @@
 
 #include <vector>
 #include <memory>
+#include <limits>
 #include "MZDataIdentifier.h"
+#include "MZThreadPool.h"
+#include "MZMemoryBudget.h"
 
 namespace MZDR
 {
   struct TextPos
   {
     TextPos() {}
-    TextPos(DWORD lineIdx, DWORD lineOffset)
+    TextPos(size_t lineIdx, size_t lineOffset)
       : nLine(lineIdx)
       , nLineOffset(lineOffset)
     {}
 
-    DWORD nLine;
-    DWORD nLineOffset; // in characters
+    size_t nLine;
+    size_t nLineOffset; // in characters
   };
 
   struct TextRange
@@ -23,7 +26,7 @@ namespace MZDR
     TextRange()
     {
     }
-    TextRange(DWORD nStartLineIdx, DWORD nStartLineOffset, DWORD nEndLineIdx, DWORD nEndLineOffset)
+    TextRange(size_t nStartLineIdx, size_t nStartLineOffset, size_t nEndLineIdx, size_t nEndLineOffset)
       : start(nStartLineIdx, nStartLineOffset)
       , end(nEndLineIdx, nEndLineOffset)
     {
@@ -33,15 +36,6 @@ namespace MZDR
     TextPos end;
   };
 
-  enum NewLine
-  {
-    NoNewLine = 0,
-    CR, // \r
-    LF, // \n
-    CRLF,
-    Unknown,
-  };
-
   template<typename T>
   class LineHelper
   {
@@ -64,8 +58,20 @@ namespace MZDR
       len = dwNewLineLenInBytes;
       return pData;
     }
-  protected:
-    static void GetNewLine(char* sz, int len, MZDR::NewLine newLineType)
+
+    // Newline type of a line. CR and LF is found from the newline character after the line data
+    template<class L>
+    static MZDR::NewLine GetLineNewLine(const L& line)
+    {
+      if (line.nBytesForNewLine == 2 * sizeof(T))
+        return MZDR::CRLF;
+      if (line.nBytesForNewLine == sizeof(T))
+        return (*reinterpret_cast<const T*>(line.pLine + line.lenght) == 0x0d) ? MZDR::CR : MZDR::LF;
+      return MZDR::NoNewLine;
+    }
+
+    // Write the newline characters for newLineType to sz. Returns number of characters
+    static size_t GetNewLine(char* sz, int len, MZDR::NewLine newLineType)
     {
       if (newLineType == MZDR::CR)
         strcpy_s(sz, len, "\r");
@@ -73,9 +79,13 @@ namespace MZDR
         strcpy_s(sz, len, "\n");
       else if (newLineType == MZDR::CRLF)
         strcpy_s(sz, len, "\r\n");
+      else
+        return 0;
+
+      return strlen(sz);
     }
 
-    static void GetNewLine(wchar_t* sz, int len, MZDR::NewLine newLineType)
+    static size_t GetNewLine(wchar_t* sz, int len, MZDR::NewLine newLineType)
     {
       if (newLineType == MZDR::CR)
         wcscpy_s(sz, len, L"\r");
@@ -83,33 +93,107 @@ namespace MZDR
         wcscpy_s(sz, len, L"\n");
       else if (newLineType == MZDR::CRLF)
         wcscpy_s(sz, len, L"\r\n");
-    }
-
+      else
+        return 0;
 
+      return wcslen(sz);
+    }
   };
 
   template<class L>
   class LinesData
   {
   public:
-    BYTE* AllocateBuffer(DWORD nSize)
+    typedef L LineType;
+    typedef decltype(L::lenght) LineLengthType; // Line length in L. DWORD keeps the line small. Use a 64 bit type for lines over 4 GB
+
+    BYTE* AllocateBuffer(size_t nSize)
     {
       auto spBuffer = std::make_unique<BYTE[]>(nSize);
       auto pBuffer = spBuffer.get();
       m_vBuffers.push_back(std::move(spBuffer));
+      m_vBufferSizes.push_back(nSize);
+
+      m_nBufferBytes += nSize;
+      UpdateMemoryCharge();
       return pBuffer;
     }
 
-    void InsertLine(const BYTE* pLine, DWORD lenBytes, NewLine newLineCharacters, BYTE numBytesForNewLine)
+    size_t NumBuffers() const { return m_vBuffers.size(); }
+    const BYTE* GetBuffer(size_t nIdx) const { return m_vBuffers.at(nIdx).get(); }
+    size_t GetBufferSize(size_t nIdx) const { return m_vBufferSizes.at(nIdx); }
+
+    // Move all buffers to the caller. All lines are removed since they point in to the buffers
+    void DetachBuffers(std::vector<std::unique_ptr<BYTE[]>>& vBuffers, std::vector<size_t>& vBufferSizes)
     {
-      m_vItems.push_back(L(pLine, lenBytes, newLineCharacters, numBytesForNewLine));
+      vBuffers = std::move(m_vBuffers);
+      vBufferSizes = std::move(m_vBufferSizes);
+
+      m_vBuffers.clear();
+      m_vBufferSizes.clear();
+      std::vector<L>().swap(m_vItems);
+      m_vSourceFirstLine.clear();
+
+      // Buffers are not counted any more
+      m_nBufferBytes = 0;
+      UpdateMemoryCharge();
+    }
+
+    void InsertLine(const BYTE* pLine, size_t lenBytes, NewLine newLineCharacters, BYTE numBytesForNewLine)
+    {
+      if (lenBytes > static_cast<size_t>((std::numeric_limits<LineLengthType>::max)()))
+        throw MZDataReaderException(ERROR_ARITHMETIC_OVERFLOW, "Line is too long for the line type");
+
+      size_t nCapacity = m_vItems.capacity();
+      m_vItems.push_back(L(pLine, static_cast<LineLengthType>(lenBytes), newLineCharacters, numBytesForNewLine));
+      if (m_vItems.capacity() != nCapacity)
+        UpdateMemoryCharge();
     }
 
     void ReserveLines(size_t lines)
     {
       m_vItems.reserve(lines);
+      UpdateMemoryCharge();
     }
 
+    // Move all buffers and lines from other to the end of this. Line data is not copied.
+    // Index of first line from other is recorded as a source boundary
+    void Append(LinesData&& other)
+    {
+      m_vSourceFirstLine.push_back(m_vItems.size());
+
+      for (auto&& spBuffer : other.m_vBuffers)
+        m_vBuffers.push_back(std::move(spBuffer));
+      m_vBufferSizes.insert(m_vBufferSizes.end(), other.m_vBufferSizes.begin(), other.m_vBufferSizes.end());
+
+      m_vItems.insert(m_vItems.end(), other.m_vItems.begin(), other.m_vItems.end());
+      m_nBufferBytes += other.m_nBufferBytes;
+
+      other.m_vBuffers.clear();
+      other.m_vBufferSizes.clear();
+      std::vector<L>().swap(other.m_vItems);
+      other.m_vSourceFirstLine.clear();
+      other.m_nBufferBytes = 0;
+
+      other.UpdateMemoryCharge();
+      UpdateMemoryCharge();
+    }
+
+    // Memory used by buffers and the line index. Also counted in MemoryBudget::Global()
+    MemoryUsageInfo MemoryUsage() const
+    {
+      MemoryUsageInfo info;
+      info.nBufferBytes = m_nBufferBytes;
+      info.nIndexBytes = m_vItems.size() * sizeof(L);
+      info.nIndexSlackBytes = (m_vItems.capacity() - m_vItems.size()) * sizeof(L);
+      info.nOtherBytes = m_vBuffers.capacity() * sizeof(std::unique_ptr<BYTE[]>) + m_vBufferSizes.capacity() * sizeof(size_t)
+        + m_vSourceFirstLine.capacity() * sizeof(size_t);
+      return info;
+    }
+
+    // Index of first line for each LinesData added with Append()
+    const std::vector<size_t>& GetSourceBoundaries() const { return m_vSourceFirstLine; }
+
     void ContentFormat(MZDR::ContentFormat format)
     {
       m_ContentFormat = format;
@@ -122,31 +206,84 @@ namespace MZDR
 
     size_t NumLines() const { return m_vItems.size();  }
 
+    // All lines joined with szNewLine. Newline is written between all lines, also before empty lines
     template<typename T>
-    std::unique_ptr<T[]> GetLinesAsText(const T* szNewLine, DWORD len) const
+    std::unique_ptr<T[]> GetLinesAsText(const T* szNewLine, size_t len) const
     {
       size_t total = TotalLineSize(len*sizeof(T)) + 4;
       auto spBuffer = std::make_unique<T[]>(total/sizeof(T));
-      ZeroMemory(spBuffer.get(), total);
 
       BYTE* pPos = reinterpret_cast<BYTE*>(spBuffer.get());
       BYTE* pPosBegin = reinterpret_cast<BYTE*>(spBuffer.get());
-      for (auto&& line : m_vItems)
+      for (size_t i = 0; i < m_vItems.size(); i++)
       {
-        if (pPos > pPosBegin)
+        if (i > 0)
         {
           CopyMemory(pPos, szNewLine, len*sizeof(T));
           pPos += len*sizeof(T);
         }
 
-        CopyMemory(pPos, line.pLine, line.lenght);
-        pPos += line.lenght;
+        CopyMemory(pPos, m_vItems[i].pLine, m_vItems[i].lenght);
+        pPos += m_vItems[i].lenght;
       }
+
+      // Only zero the tail. Everything before it has been written
+      ZeroMemory(pPos, total - (pPos - pPosBegin));
       return spBuffer;
     }
 
+    // Same as GetLinesAsText. But lines are copied by multiple threads. nThreads = 0 will use one thread per core
+    //  A thread pool is only created if there is enough lines to split the work
+    template<typename T>
+    std::unique_ptr<T[]> GetLinesAsTextParallel(const T* szNewLine, size_t len, size_t nThreads = 0) const
+    {
+      std::unique_ptr<ThreadPool> spPool = CreateTextPool(nThreads);
+      return GetLinesAsTextParallelT(szNewLine, len, spPool.get(), nThreads);
+    }
+
+    // Same as above. Use the threads of pool. Use when text is created many times
+    template<typename T>
+    std::unique_ptr<T[]> GetLinesAsTextParallel(const T* szNewLine, size_t len, ThreadPool& pool) const
+    {
+      return GetLinesAsTextParallelT(szNewLine, len, &pool, pool.NumThreads());
+    }
+
+    // Size in bytes of all lines joined with a newline of lenNewLineBytes. Not including zero termination
+    size_t LinesAsTextSize(size_t lenNewLineBytes) const
+    {
+      if (m_vItems.empty())
+        return 0;
+
+      return TotalLineSize(lenNewLineBytes) - lenNewLineBytes;
+    }
+
+    // Write all lines joined with szNewLine to pDest. Use LinesAsTextSize() to get the size needed
+    //  pDest can be a memory mapped file. Byte offset of each block of lines is found using a prefix sum
+    //  of the block sizes. Then all blocks are copied in parallel. Returns number of bytes written
+    template<typename T>
+    size_t WriteLinesAsText(BYTE* pDest, size_t destSize, const T* szNewLine, size_t len, size_t nThreads = 0) const
+    {
+      std::unique_ptr<ThreadPool> spPool = CreateTextPool(nThreads);
+      return WriteLinesAsTextT(pDest, destSize, szNewLine, len, spPool.get(), nThreads);
+    }
+
+    // Same as above. Use the threads of pool
+    template<typename T>
+    size_t WriteLinesAsText(BYTE* pDest, size_t destSize, const T* szNewLine, size_t len, ThreadPool& pool) const
+    {
+      return WriteLinesAsTextT(pDest, destSize, szNewLine, len, &pool, pool.NumThreads());
+    }
+
     const std::vector<L>& GetLines() { return m_vItems; }
 
+    // Call fn(const L& line) for each line in order
+    template<class F>
+    void ForEachLine(F fn) const
+    {
+      for (auto&& line : m_vItems)
+        fn(line);
+    }
+
     L* GetLine(size_t nIdx)
     {
       return &(m_vItems.at(nIdx));
@@ -187,7 +324,7 @@ namespace MZDR
       return newLineStyle;
     }
 
-    size_t TotalLineSize(DWORD extraPerLine) const
+    size_t TotalLineSize(size_t extraPerLine) const
     {
       size_t nTotalLength = 0;
       for (auto&& l : m_vItems)
@@ -199,8 +336,139 @@ namespace MZDR
     }
 
   protected:
+    // Lines split in blocks for the parallel text copy. vOffsets[i] is the byte offset of block i. Last is the total size
+    struct TextBlocks
+    {
+      size_t nLinesPerBlock = 0;
+      std::vector<size_t> vOffsets;
+
+      size_t NumBlocks() const { return vOffsets.size() - 1; }
+      size_t TotalSize() const { return vOffsets.back(); }
+    };
+
+    size_t NumTextBlocks(size_t nThreads) const
+    {
+      const size_t nMinLinesPerBlock = 4096;
+
+      size_t nBlocks = nThreads * 4;
+      if (nBlocks > m_vItems.size() / nMinLinesPerBlock)
+        nBlocks = m_vItems.size() / nMinLinesPerBlock;
+      if (nBlocks < 1)
+        nBlocks = 1;
+      return nBlocks;
+    }
+
+    // nullptr if the text is copied as one block. nThreads is set to the number of threads used
+    std::unique_ptr<ThreadPool> CreateTextPool(size_t& nThreads) const
+    {
+      if (nThreads == 0)
+        nThreads = ThreadPool::DefaultThreadCount();
+
+      if (NumTextBlocks(nThreads) == 1)
+        return nullptr;
+
+      return std::make_unique<ThreadPool>(nThreads);
+    }
+
+    template<typename T>
+    std::unique_ptr<T[]> GetLinesAsTextParallelT(const T* szNewLine, size_t len, ThreadPool* pPool, size_t nThreads) const
+    {
+      const size_t nNewLineBytes = len*sizeof(T);
+      TextBlocks blocks = GetTextBlocks(pPool, nThreads, nNewLineBytes);
+
+      size_t total = blocks.TotalSize();
+      auto spBuffer = std::make_unique<T[]>(total/sizeof(T) + 1);
+      CopyTextBlocks(pPool, blocks, reinterpret_cast<BYTE*>(spBuffer.get()), szNewLine, nNewLineBytes);
+      spBuffer[total/sizeof(T)] = 0;
+      return spBuffer;
+    }
+
+    template<typename T>
+    size_t WriteLinesAsTextT(BYTE* pDest, size_t destSize, const T* szNewLine, size_t len, ThreadPool* pPool, size_t nThreads) const
+    {
+      const size_t nNewLineBytes = len*sizeof(T);
+      TextBlocks blocks = GetTextBlocks(pPool, nThreads, nNewLineBytes);
+
+      if (blocks.TotalSize() > destSize)
+        throw MZDataReaderException(ERROR_INSUFFICIENT_BUFFER, "Destination buffer is too small");
+
+      CopyTextBlocks(pPool, blocks, pDest, szNewLine, nNewLineBytes);
+      return blocks.TotalSize();
+    }
+
+    // Size of each block is found in parallel and then summed. pPool can be nullptr
+    TextBlocks GetTextBlocks(ThreadPool* pPool, size_t nThreads, size_t nNewLineBytes) const
+    {
+      const size_t nLines = m_vItems.size();
+      const size_t nBlocks = pPool ? NumTextBlocks(nThreads) : 1;
+
+      TextBlocks blocks;
+      blocks.nLinesPerBlock = (nLines + nBlocks - 1) / nBlocks;
+      blocks.vOffsets.resize(nBlocks + 1, 0);
+
+      // Newline is written before each line except the first
+      auto sizeBlock = [&](size_t nBlock)
+      {
+        size_t nFirst = nBlock * blocks.nLinesPerBlock;
+        size_t nEnd = (nFirst + blocks.nLinesPerBlock < nLines) ? nFirst + blocks.nLinesPerBlock : nLines;
+        size_t nSize = 0;
+        for (size_t i = nFirst; i < nEnd; i++)
+          nSize += m_vItems[i].lenght + ((i > 0) ? nNewLineBytes : 0);
+
+        blocks.vOffsets[nBlock + 1] = nSize;
+      };
+
+      if (nBlocks == 1)
+        sizeBlock(0);
+      else
+        pPool->ParallelFor(nBlocks, sizeBlock);
+
+      for (size_t i = 1; i <= nBlocks; i++)
+        blocks.vOffsets[i] += blocks.vOffsets[i - 1];
+
+      return blocks;
+    }
+
+    template<typename T>
+    void CopyTextBlocks(ThreadPool* pPool, const TextBlocks& blocks, BYTE* pDest, const T* szNewLine, size_t nNewLineBytes) const
+    {
+      const size_t nLines = m_vItems.size();
+      auto copyBlock = [&](size_t nBlock)
+      {
+        BYTE* pPos = pDest + blocks.vOffsets[nBlock];
+        size_t nFirst = nBlock * blocks.nLinesPerBlock;
+        size_t nEnd = (nFirst + blocks.nLinesPerBlock < nLines) ? nFirst + blocks.nLinesPerBlock : nLines;
+        for (size_t i = nFirst; i < nEnd; i++)
+        {
+          if (i > 0)
+          {
+            CopyMemory(pPos, szNewLine, nNewLineBytes);
+            pPos += nNewLineBytes;
+          }
+
+          CopyMemory(pPos, m_vItems[i].pLine, m_vItems[i].lenght);
+          pPos += m_vItems[i].lenght;
+        }
+      };
+
+      if (blocks.NumBlocks() == 1)
+        copyBlock(0);
+      else
+        pPool->ParallelFor(blocks.NumBlocks(), copyBlock);
+    }
+
+    // Buffers and index capacity are counted. Vectors of buffer pointers are small and not counted
+    void UpdateMemoryCharge()
+    {
+      m_MemoryCharge.Set(m_nBufferBytes + m_vItems.capacity() * sizeof(L));
+    }
+
     std::vector< std::unique_ptr<BYTE[]>> m_vBuffers;
+    std::vector<size_t> m_vBufferSizes;
     std::vector<L> m_vItems;
+    std::vector<size_t> m_vSourceFirstLine;
+    size_t m_nBufferBytes = 0;
+    MemoryCharge m_MemoryCharge;
 
     MZDR::ContentFormat m_ContentFormat = MZDR::ContentUnknown;
   };
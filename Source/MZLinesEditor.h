@@ -0,0 +1,321 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <random>
+
+#include "MZLinesData.h"
+#include "MZLineParser.h"
+
+namespace MZDR
+{
+  //================================
+  // Editable view of a LinesData (piece table)
+  //  The original LinesData is never modified. New lines are stored in a separate LinesData.
+  //  Pieces (ranges of lines from original or added lines) are kept in a balanced tree (treap),
+  //  so insert, delete and lookup of a line is O(log n)
+  // T MUST be char or wchar_t
+  //================================
+
+  template<class T, class TLinesData>
+  class LinesEditViewT
+  {
+  public:
+    typedef typename TLinesData::LineType Line;
+
+    // newLineStyle is used for inserted lines
+    LinesEditViewT(std::shared_ptr<TLinesData> spOriginal, NewLine newLineStyle = LF)
+      : m_spOriginal(spOriginal)
+      , m_spAdded(std::make_shared<TLinesData>())
+      , m_NewLineStyle(newLineStyle)
+    {
+      m_pSource[SourceOriginal] = &m_spOriginal->GetLines();
+      m_pSource[SourceAdded] = &m_spAdded->GetLines();
+
+      if (m_pSource[SourceOriginal]->empty() == false)
+        m_spRoot = NewNode(SourceOriginal, 0, m_pSource[SourceOriginal]->size());
+    }
+
+    size_t NumLines() const { return Size(m_spRoot); }
+
+    const Line* GetLine(size_t nIdx) const
+    {
+      const Node* pNode = m_spRoot.get();
+      while (pNode)
+      {
+        size_t nLeft = Size(pNode->spLeft);
+        if (nIdx < nLeft)
+        {
+          pNode = pNode->spLeft.get();
+        }
+        else if (nIdx < nLeft + pNode->nCount)
+        {
+          return &(*m_pSource[pNode->nSource])[pNode->nStart + (nIdx - nLeft)];
+        }
+        else
+        {
+          nIdx -= nLeft + pNode->nCount;
+          pNode = pNode->spRight.get();
+        }
+      }
+
+      throw MZDataReaderException(ERROR_INVALID_INDEX, "Line index out of range");
+    }
+
+    // szText MUST not contain newlines
+    void InsertLine(size_t nIdx, const T* szText, size_t nChars)
+    {
+      std::vector<TextSpan> vLines(1, TextSpan(szText, nChars));
+      InsertLines(nIdx, vLines, m_NewLineStyle);
+    }
+
+    void ReplaceLine(size_t nIdx, const T* szText, size_t nChars)
+    {
+      NewLine newLine = LineHelper<T>::GetLineNewLine(*GetLine(nIdx));
+      DeleteLines(nIdx, 1);
+
+      std::vector<TextSpan> vLines(1, TextSpan(szText, nChars));
+      InsertLines(nIdx, vLines, newLine);
+    }
+
+    void DeleteLines(size_t nIdx, size_t nCount)
+    {
+      if (nIdx + nCount > NumLines())
+        throw MZDataReaderException(ERROR_INVALID_INDEX, "Line index out of range");
+
+      NodePtr spLeft, spMiddle, spRight;
+      Split(std::move(m_spRoot), nIdx, spLeft, spMiddle);
+      Split(std::move(spMiddle), nCount, spMiddle, spRight);
+      m_spRoot = Merge(std::move(spLeft), std::move(spRight));
+    }
+
+    // Replace text in range with szText. szText can contain newlines
+    void ReplaceRange(const TextRange& range, const T* szText, size_t nChars)
+    {
+      if (range.end.nLine < range.start.nLine)
+        throw MZDataReaderException(ERROR_INVALID_INDEX, "Line index out of range");
+
+      const Line* pStart = GetLine(range.start.nLine);
+      const Line* pEnd = GetLine(range.end.nLine);
+
+      const T* pStartText = reinterpret_cast<const T*>(pStart->pLine);
+      const T* pEndText = reinterpret_cast<const T*>(pEnd->pLine);
+      size_t nEndChars = pEnd->lenght / sizeof(T);
+      if (range.start.nLineOffset > pStart->lenght / sizeof(T) || range.end.nLineOffset > nEndChars ||
+          (range.start.nLine == range.end.nLine && range.end.nLineOffset < range.start.nLineOffset))
+        throw MZDataReaderException(ERROR_INVALID_INDEX, "Line offset out of range");
+
+      // New text = start of first line + szText + end of last line.
+      std::basic_string<T> strText(pStartText, range.start.nLineOffset);
+      if (szText)
+        strText.append(szText, nChars);
+      strText.append(pEndText + range.end.nLineOffset, nEndChars - range.end.nLineOffset);
+
+      // Last line keep the newline of the original last line
+      NewLine lastNewLine = LineHelper<T>::GetLineNewLine(*pEnd);
+
+      std::vector<TextSpan> vLines;
+      const T* pText = strText.c_str();
+      const T* pTextEnd = pText + strText.length();
+      do
+      {
+        auto result = LineParserT<T>::ParseLine(pText, pTextEnd);
+        if (result.pLine == nullptr)
+        {
+          vLines.push_back(TextSpan(pText, 0)); // Text ended with newline.
+          break;
+        }
+
+        vLines.push_back(TextSpan(pText, result.length / sizeof(T)));
+        pText = reinterpret_cast<const T*>(result.pNextLine);
+        if (result.bEndOfDataReached && result.nCharsForNewLine == 0)
+          break;
+      } while (true);
+
+      DeleteLines(range.start.nLine, range.end.nLine - range.start.nLine + 1);
+      InsertLines(range.start.nLine, vLines, lastNewLine);
+    }
+
+    void DeleteRange(const TextRange& range)
+    {
+      ReplaceRange(range, nullptr, 0);
+    }
+
+    // fn(const Line* pLines, size_t nCount) is called for each piece in order
+    template<class F>
+    void ForEachPiece(F fn) const
+    {
+      ForEachPiece(m_spRoot.get(), fn);
+    }
+
+    // Call fn(const Line& line) for each line in order. Can be used with LineDataWriter::WriteLinesToDataWriter
+    template<class F>
+    void ForEachLine(F fn) const
+    {
+      ForEachPiece([&](const Line* pLines, size_t nCount)
+      {
+        for (size_t i = 0; i < nCount; i++)
+          fn(pLines[i]);
+      });
+    }
+
+  protected:
+    enum
+    {
+      SourceOriginal = 0,
+      SourceAdded = 1,
+    };
+
+    struct TextSpan
+    {
+      TextSpan(const T* p, size_t n) : pText(p), nChars(n) {}
+      const T* pText;
+      size_t nChars;
+    };
+
+    struct Node;
+    typedef std::unique_ptr<Node> NodePtr;
+
+    struct Node
+    {
+      BYTE nSource;
+      size_t nStart;
+      size_t nCount;
+      size_t nSubtreeLines;
+      unsigned int nPriority;
+      NodePtr spLeft;
+      NodePtr spRight;
+    };
+
+    static size_t Size(const NodePtr& spNode) { return spNode ? spNode->nSubtreeLines : 0; }
+
+    static void Update(Node* pNode)
+    {
+      pNode->nSubtreeLines = Size(pNode->spLeft) + pNode->nCount + Size(pNode->spRight);
+    }
+
+    NodePtr NewNode(BYTE nSource, size_t nStart, size_t nCount)
+    {
+      NodePtr spNode(new Node());
+      spNode->nSource = nSource;
+      spNode->nStart = nStart;
+      spNode->nCount = nCount;
+      spNode->nSubtreeLines = nCount;
+      spNode->nPriority = m_Random();
+      return spNode;
+    }
+
+    // Left get the first nLines lines. A piece is split in two if needed
+    void Split(NodePtr spNode, size_t nLines, NodePtr& spLeft, NodePtr& spRight)
+    {
+      if (!spNode)
+      {
+        spLeft.reset();
+        spRight.reset();
+        return;
+      }
+
+      size_t nLeft = Size(spNode->spLeft);
+      if (nLines <= nLeft)
+      {
+        NodePtr spTmp;
+        Split(std::move(spNode->spLeft), nLines, spLeft, spTmp);
+        spNode->spLeft = std::move(spTmp);
+        Update(spNode.get());
+        spRight = std::move(spNode);
+      }
+      else if (nLines >= nLeft + spNode->nCount)
+      {
+        NodePtr spTmp;
+        Split(std::move(spNode->spRight), nLines - nLeft - spNode->nCount, spTmp, spRight);
+        spNode->spRight = std::move(spTmp);
+        Update(spNode.get());
+        spLeft = std::move(spNode);
+      }
+      else
+      {
+        // Split inside this piece
+        size_t nOffset = nLines - nLeft;
+        NodePtr spSecond = NewNode(spNode->nSource, spNode->nStart + nOffset, spNode->nCount - nOffset);
+        NodePtr spAfter = std::move(spNode->spRight);
+
+        spNode->nCount = nOffset;
+        Update(spNode.get());
+
+        spLeft = std::move(spNode);
+        spRight = Merge(std::move(spSecond), std::move(spAfter));
+      }
+    }
+
+    static NodePtr Merge(NodePtr spLeft, NodePtr spRight)
+    {
+      if (!spLeft)
+        return spRight;
+      if (!spRight)
+        return spLeft;
+
+      if (spLeft->nPriority > spRight->nPriority)
+      {
+        spLeft->spRight = Merge(std::move(spLeft->spRight), std::move(spRight));
+        Update(spLeft.get());
+        return spLeft;
+      }
+
+      spRight->spLeft = Merge(std::move(spLeft), std::move(spRight->spLeft));
+      Update(spRight.get());
+      return spRight;
+    }
+
+    // Copy lines to the added lines buffer and insert them as one piece
+    void InsertLines(size_t nIdx, const std::vector<TextSpan>& vLines, NewLine lastNewLine)
+    {
+      if (nIdx > NumLines())
+        throw MZDataReaderException(ERROR_INVALID_INDEX, "Line index out of range");
+
+      size_t nTotalBytes = 0;
+      for (auto&& line : vLines)
+        nTotalBytes += (line.nChars + 2) * sizeof(T);
+
+      BYTE* pBuffer = m_spAdded->AllocateBuffer(nTotalBytes);
+      size_t nFirst = m_spAdded->NumLines();
+
+      for (size_t i = 0; i < vLines.size(); i++)
+      {
+        NewLine newLine = (i + 1 == vLines.size()) ? lastNewLine : m_NewLineStyle;
+        T szNewLine[4] = { 0 };
+        size_t nNewLineChars = LineHelper<T>::GetNewLine(szNewLine, _countof(szNewLine), newLine);
+
+        size_t nBytes = vLines[i].nChars * sizeof(T);
+        CopyMemory(pBuffer, vLines[i].pText, nBytes);
+        CopyMemory(pBuffer + nBytes, szNewLine, nNewLineChars * sizeof(T));
+
+        m_spAdded->InsertLine(pBuffer, nBytes, newLine, static_cast<BYTE>(nNewLineChars * sizeof(T)));
+        pBuffer += nBytes + nNewLineChars * sizeof(T);
+      }
+
+      NodePtr spLeft, spRight;
+      Split(std::move(m_spRoot), nIdx, spLeft, spRight);
+      m_spRoot = Merge(Merge(std::move(spLeft), NewNode(SourceAdded, nFirst, vLines.size())), std::move(spRight));
+    }
+
+    template<class F>
+    void ForEachPiece(const Node* pNode, F& fn) const
+    {
+      if (pNode == nullptr)
+        return;
+
+      ForEachPiece(pNode->spLeft.get(), fn);
+      fn(m_pSource[pNode->nSource]->data() + pNode->nStart, pNode->nCount);
+      ForEachPiece(pNode->spRight.get(), fn);
+    }
+
+    std::shared_ptr<TLinesData> m_spOriginal;
+    std::shared_ptr<TLinesData> m_spAdded;
+    const std::vector<Line>* m_pSource[2];
+
+    NodePtr m_spRoot;
+    NewLine m_NewLineStyle;
+    std::minstd_rand m_Random;
+  };
+
+}
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <atomic>
+#include <stddef.h>
+
+namespace MZDR
+{
+  struct MemoryUsageInfo
+  {
+    size_t nBufferBytes = 0;      // Line data
+    size_t nIndexBytes = 0;       // Lines in the line index
+    size_t nIndexSlackBytes = 0;  // Unused capacity of the line index
+    size_t nOtherBytes = 0;       // Bookkeeping and caches
+
+    size_t Total() const { return nBufferBytes + nIndexBytes + nIndexSlackBytes + nOtherBytes; }
+  };
+
+  //================================
+  // Process wide memory accounting. LinesData (and the other line containers) add the memory they use.
+  //  A limit can be set. It is not enforced by allocations. LineReaderT checks it after each chunk and stops loading
+  //  (see LineReaderT::ReadLinesFromDataReaderWithBudget)
+  //================================
+
+  class MemoryBudget
+  {
+  public:
+    static MemoryBudget& Global()
+    {
+      static MemoryBudget budget;
+      return budget;
+    }
+
+    // 0 = no limit
+    void SetLimit(size_t nBytes) { m_nLimit = nBytes; }
+    size_t Limit() const { return m_nLimit; }
+    size_t Used() const { return m_nUsed; }
+
+    bool IsExceeded() const
+    {
+      size_t nLimit = m_nLimit;
+      return nLimit > 0 && m_nUsed > nLimit;
+    }
+
+    // True if nBytes more would exceed the limit
+    bool WouldExceed(size_t nBytes) const
+    {
+      size_t nLimit = m_nLimit;
+      return nLimit > 0 && m_nUsed + nBytes > nLimit;
+    }
+
+    void Add(size_t nBytes) { m_nUsed += nBytes; }
+    void Remove(size_t nBytes) { m_nUsed -= nBytes; }
+
+  protected:
+    std::atomic<size_t> m_nUsed{ 0 };
+    std::atomic<size_t> m_nLimit{ 0 };
+  };
+
+  //================================
+  // Memory counted in the global budget by one object. Removed when destroyed
+  //================================
+
+  class MemoryCharge
+  {
+  public:
+    MemoryCharge()
+    {
+    }
+
+    ~MemoryCharge()
+    {
+      Set(0);
+    }
+
+    MemoryCharge(const MemoryCharge&) = delete;
+    MemoryCharge& operator=(const MemoryCharge&) = delete;
+
+    // Charge moves with the memory it counts. The global total is not changed
+    MemoryCharge(MemoryCharge&& other)
+      : m_nBytes(other.m_nBytes)
+    {
+      other.m_nBytes = 0;
+    }
+
+    MemoryCharge& operator=(MemoryCharge&& other)
+    {
+      if (this != &other)
+      {
+        Set(0);
+        m_nBytes = other.m_nBytes;
+        other.m_nBytes = 0;
+      }
+      return *this;
+    }
+
+    void Set(size_t nBytes)
+    {
+      if (nBytes > m_nBytes)
+        MemoryBudget::Global().Add(nBytes - m_nBytes);
+      else if (nBytes < m_nBytes)
+        MemoryBudget::Global().Remove(m_nBytes - nBytes);
+      m_nBytes = nBytes;
+    }
+
+    size_t Get() const { return m_nBytes; }
+
+  protected:
+    size_t m_nBytes = 0;
+  };
+
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include "MZDataIdentifier.h"
+#include "MZDataReaderException.h"
+#include "MZSimd.h"
+
+namespace MZDR
+{
+  //================================
+  // Convert all newlines (CR, LF and CRLF) in a buffer to one newline style.
+  //  Newlines are found 16 characters at a time and the text between them is block copied.
+  //  Data can be converted in chunks. A CRLF split between two chunks is handled
+  // T MUST be char or wchar_t
+  //================================
+
+  template<class T>
+  class NewLineConverterT
+  {
+  public:
+    NewLineConverterT(NewLine newLine)
+      : m_NewLine(newLine)
+    {
+      if (newLine == CR)
+        m_szNewLine[m_nNewLineChars++] = CRChar;
+      else if (newLine == LF)
+        m_szNewLine[m_nNewLineChars++] = LFChar;
+      else if (newLine == CRLF)
+      {
+        m_szNewLine[m_nNewLineChars++] = CRChar;
+        m_szNewLine[m_nNewLineChars++] = LFChar;
+      }
+      else
+        throw MZDataReaderException(ERROR_INVALID_PARAMETER, "Newline must be CR, LF or CRLF");
+    }
+
+    NewLine GetNewLineStyle() const { return m_NewLine; }
+
+    // Max number of characters Convert() can write for nChars input
+    static size_t MaxConvertedChars(size_t nChars) { return nChars * 2; }
+
+    // Convert next chunk of data. pDest MUST have room for MaxConvertedChars(pEnd - pData). Returns number of characters written
+    size_t Convert(const T* pData, const T* pEnd, T* pDest)
+    {
+      T* pOut = pDest;
+
+      // Last chunk ended with CR. Newline is already written
+      if (m_bPendingCR && pData < pEnd)
+      {
+        if (*pData == LFChar)
+          pData++;
+        m_bPendingCR = false;
+      }
+
+      while (pData < pEnd)
+      {
+        const T* pNewLine = SimdHelperT<T>::FindFirstOf(pData, pEnd, CRChar, LFChar);
+
+        size_t nChars = pNewLine - pData;
+        CopyMemory(pOut, pData, nChars * sizeof(T));
+        pOut += nChars;
+
+        if (pNewLine == pEnd)
+          break;
+
+        for (DWORD i = 0; i < m_nNewLineChars; i++)
+          *pOut++ = m_szNewLine[i];
+
+        if (*pNewLine == CRChar)
+        {
+          if (pNewLine + 1 == pEnd)
+          {
+            m_bPendingCR = true;
+            break;
+          }
+          if (pNewLine[1] == LFChar)
+            pNewLine++;
+        }
+
+        pData = pNewLine + 1;
+      }
+
+      return pOut - pDest;
+    }
+
+    // Start a new stream
+    void Reset() { m_bPendingCR = false; }
+
+  protected:
+    static const T CRChar = 0x0d;
+    static const T LFChar = 0x0a;
+
+    NewLine m_NewLine;
+    T m_szNewLine[2];
+    DWORD m_nNewLineChars = 0;
+    bool m_bPendingCR = false;
+  };
+
+}
@@ -0,0 +1,133 @@
+#pragma once
+
+//================================
+// Platform types and helpers used by all headers.
+//  Windows use the Win32 headers. Other platforms get the few Win32 types and CRT helpers used here.
+//  On POSIX the error code in MZDataReaderException is always an errno value. ERROR_ codes are mapped to errno
+//================================
+
+#ifdef _WIN32
+
+#include <WinBase.h>
+#include "../../MZMisc/Source/AutoHandle.h"
+
+#else
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <wchar.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+typedef uint32_t DWORD;
+typedef uint8_t BYTE;
+typedef int BOOL;
+typedef char CHAR;
+typedef unsigned char UCHAR;
+typedef uint64_t ULONGLONG;
+typedef char TCHAR;
+
+#ifndef TRUE
+#define TRUE 1
+#define FALSE 0
+#endif
+
+#define OUT
+#define _T(x) x
+
+#define CopyMemory(pDest, pSource, nLen) memcpy((pDest), (pSource), (nLen))
+#define MoveMemory(pDest, pSource, nLen) memmove((pDest), (pSource), (nLen))
+#define ZeroMemory(pDest, nLen) memset((pDest), 0, (nLen))
+
+#ifndef _countof
+#define _countof(a) (sizeof(a) / sizeof((a)[0]))
+#endif
+
+#define ERROR_FILE_NOT_FOUND ENOENT
+#define ERROR_NOT_ENOUGH_MEMORY ENOMEM
+#define ERROR_OUTOFMEMORY ENOMEM
+#define ERROR_INVALID_DATA EILSEQ
+#define ERROR_HANDLE_EOF ENODATA
+#define ERROR_NOT_SUPPORTED ENOTSUP
+#define ERROR_INVALID_PARAMETER EINVAL
+#define ERROR_INSUFFICIENT_BUFFER ENOBUFS
+#define ERROR_ALREADY_EXISTS EEXIST
+#define ERROR_ARITHMETIC_OVERFLOW EOVERFLOW
+#define ERROR_INVALID_INDEX ERANGE
+
+#define INVALID_FILE_ATTRIBUTES ((DWORD)-1)
+#define _TRUNCATE ((size_t)-1)
+
+inline int strcpy_s(char* szDest, size_t nDestSize, const char* szSource)
+{
+  if (strlen(szSource) >= nDestSize)
+    return ERANGE;
+  strcpy(szDest, szSource);
+  return 0;
+}
+
+inline int wcscpy_s(wchar_t* szDest, size_t nDestSize, const wchar_t* szSource)
+{
+  if (wcslen(szSource) >= nDestSize)
+    return ERANGE;
+  wcscpy(szDest, szSource);
+  return 0;
+}
+
+// nCount can be _TRUNCATE. Result is always zero terminated
+inline int strncpy_s(char* szDest, size_t nDestSize, const char* szSource, size_t nCount)
+{
+  if (nDestSize == 0)
+    return EINVAL;
+
+  size_t nLen = strnlen(szSource, nCount == _TRUNCATE ? nDestSize : nCount);
+  if (nLen >= nDestSize)
+    nLen = nDestSize - 1;
+
+  memcpy(szDest, szSource, nLen);
+  szDest[nLen] = 0;
+  return 0;
+}
+
+inline int _tcsncpy_s(char* szDest, size_t nDestSize, const char* szSource, size_t nCount)
+{
+  return strncpy_s(szDest, nDestSize, szSource, nCount);
+}
+
+inline int _vsntprintf_s(char* szDest, size_t nDestSize, size_t /*nCount*/, const char* szFormat, va_list vaList)
+{
+  int nRetVal = vsnprintf(szDest, nDestSize, szFormat, vaList);
+  return (nRetVal < 0 || static_cast<size_t>(nRetVal) >= nDestSize) ? -1 : nRetVal;
+}
+
+// Only used to check if a file exists
+inline DWORD GetFileAttributes(const char* filename)
+{
+  struct stat st;
+  return (::stat(filename, &st) == 0) ? 0 : INVALID_FILE_ATTRIBUTES;
+}
+
+inline BOOL MoveFile(const char* szExistingName, const char* szNewName)
+{
+  return ::rename(szExistingName, szNewName) == 0;
+}
+
+#endif // _WIN32
+
+#include <string>
+
+#ifndef STL_string
+#define STL_string std::string
+#ifndef _UNICODE
+typedef STL_string	 STLString;
+#endif
+#endif
+
+#ifndef STL_wstring
+#define STL_wstring std::wstring
+#ifdef _UNICODE
+typedef STL_wstring  STLString;
+#endif
+#endif
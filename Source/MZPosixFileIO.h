@@ -0,0 +1,6 @@
+#pragma once
+
+// PosixFileDataReader and PosixFileDataWriter are declared with the other readers and writers.
+//  On non Windows platforms FileDataReader and FileDataWriter use them
+#include "MZDataReader.h"
+#include "MZDataWriter.h"
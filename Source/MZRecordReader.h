@@ -0,0 +1,204 @@
+#pragma once
+#include <vector>
+#include <memory>
+
+#include "MZDataReader.h"
+#include "MZDataWriter.h"
+#include "MZLinesData.h"
+
+namespace MZDR
+{
+  enum RecordFormat
+  {
+    RecordFixedSize = 0,        // All records have the same size
+    RecordLengthPrefixU32,      // 32 bit little endian length before each record
+    RecordLengthPrefixVarint,   // LEB128 varint length before each record
+  };
+
+  //================================
+  // Read binary records in to a LinesData. Each record is inserted as a line without newline.
+  //  The line points to the record data (length prefix is not included)
+  //================================
+
+  template<class TLinesData>
+  class RecordReaderT
+  {
+  public:
+    RecordReaderT(RecordFormat format, DWORD nRecordSize = 0)
+      : m_Format(format)
+      , m_nRecordSize(nRecordSize)
+    {
+      if (m_Format == RecordFixedSize && m_nRecordSize == 0)
+        throw MZDataReaderException(ERROR_INVALID_DATA, "Record size can not be 0");
+    }
+
+    // Records point directly in to pData. No data is copied. pData MUST be valid for as long as the result is used
+    std::shared_ptr<TLinesData> ReadRecordsFromBuffert(const BYTE* pData, size_t buffLen)
+    {
+      auto pLinesData = std::make_shared<TLinesData>();
+      pLinesData->ContentFormat(MZDR::ContentBinary);
+      pLinesData->ReserveLines(EstimateRecords(buffLen));
+
+      ParseBuffert(pLinesData, pData, pData + buffLen, true);
+      return pLinesData;
+    }
+
+    // Records are read in to buffers owned by the LinesData. Record data is copied once (by the read)
+    std::shared_ptr<TLinesData> ReadRecordsFromDataReader(MZDR::DataReader* pReader)
+    {
+      size_t nLeftToRead = pReader->TotalDataSize();
+
+      auto pLinesData = std::make_shared<TLinesData>();
+      pLinesData->ContentFormat(MZDR::ContentBinary);
+      pLinesData->ReserveLines(EstimateRecords(nLeftToRead));
+
+      size_t nBufferSize = m_ChunkSize;
+      auto pBuffer = pLinesData->AllocateBuffer(nBufferSize);
+      size_t nOffset = 0;
+
+      while (nLeftToRead)
+      {
+        size_t nBytesRead = 0;
+        pReader->ReadDataThrow(pBuffer + nOffset, nBufferSize - nOffset, &nBytesRead);
+
+        nLeftToRead -= nBytesRead;
+        bool bLastChunk = (nLeftToRead == 0 || nBytesRead == 0);
+
+        const BYTE* pEndOfData = pBuffer + nOffset + nBytesRead;
+        size_t nNeeded = 0;
+        const BYTE* pIncomplete = ParseBuffert(pLinesData, pBuffer, pEndOfData, bLastChunk, &nNeeded);
+        if (bLastChunk)
+          break;
+
+        // Move incomplete record to next buffer. Make sure the complete record fits
+        size_t nCarry = pEndOfData - pIncomplete;
+        nBufferSize = (nNeeded > m_ChunkSize) ? nNeeded : m_ChunkSize;
+        pBuffer = pLinesData->AllocateBuffer(nBufferSize);
+        if (nCarry)
+          CopyMemory(pBuffer, pIncomplete, nCarry);
+        nOffset = nCarry;
+      }
+
+      return pLinesData;
+    }
+
+    // Write records with length prefix (if any) in the format of this reader
+    template<class LineData>
+    void WriteRecords(DataWriter* pWriter, LineData& pData)
+    {
+      for (auto&& line : pData->GetLines())
+      {
+        BYTE prefix[8];
+        DWORD nPrefix = 0;
+        size_t nLineLength = static_cast<size_t>(line.lenght);
+
+        // Both length prefixes are limited to 32 bits when they are read
+        if (m_Format != RecordFixedSize && nLineLength > 0xFFFFFFFF)
+          throw MZDataReaderException(ERROR_ARITHMETIC_OVERFLOW, "Record is too long for the length prefix");
+
+        DWORD len = static_cast<DWORD>(nLineLength);
+
+        if (m_Format == RecordLengthPrefixU32)
+        {
+          for (; nPrefix < 4; nPrefix++)
+            prefix[nPrefix] = static_cast<BYTE>(len >> (8 * nPrefix));
+        }
+        else if (m_Format == RecordLengthPrefixVarint)
+        {
+          do
+          {
+            prefix[nPrefix] = static_cast<BYTE>(len & 0x7F);
+            len >>= 7;
+            if (len)
+              prefix[nPrefix] |= 0x80;
+            nPrefix++;
+          } while (len);
+        }
+
+        pWriter->WriteData(prefix, nPrefix);
+        pWriter->WriteData(line.pLine, line.lenght);
+      }
+    }
+
+  protected:
+    size_t EstimateRecords(size_t nDataSize)
+    {
+      if (m_Format == RecordFixedSize)
+        return nDataSize / m_nRecordSize + 1;
+
+      return nDataSize / 64; // Assumes 64 byte average per record
+    }
+
+    // Returns position of the first incomplete record (or pEnd). pNeeded is set to the size needed for the complete record
+    const BYTE* ParseBuffert(std::shared_ptr<TLinesData>& spLinesData, const BYTE* pData, const BYTE* pEnd, bool bLastChunk, size_t* pNeeded = nullptr)
+    {
+      while (pData < pEnd)
+      {
+        DWORD nHeader = 0;
+        DWORD nLength = 0;
+        bool bHeader = ParseRecordHeader(pData, pEnd, nHeader, nLength);
+        if (bHeader == false || static_cast<size_t>(pEnd - pData) < static_cast<size_t>(nHeader) + nLength)
+        {
+          if (bLastChunk)
+            throw MZDataReaderException(ERROR_INVALID_DATA, "Truncated record at end of data");
+
+          if (pNeeded)
+            *pNeeded = bHeader ? static_cast<size_t>(nHeader) + nLength : 16;
+          return pData;
+        }
+
+        spLinesData->InsertLine(pData + nHeader, nLength, MZDR::NoNewLine, 0);
+        pData += nHeader + nLength;
+      }
+
+      return pData;
+    }
+
+    // Returns false if the header is not complete
+    bool ParseRecordHeader(const BYTE* pData, const BYTE* pEnd, DWORD& nHeader, DWORD& nLength)
+    {
+      nHeader = 0;
+      if (m_Format == RecordFixedSize)
+      {
+        nLength = m_nRecordSize;
+        return true;
+      }
+
+      if (m_Format == RecordLengthPrefixU32)
+      {
+        if (pEnd - pData < 4)
+          return false;
+
+        nLength = pData[0] | (pData[1] << 8) | (pData[2] << 16) | (static_cast<DWORD>(pData[3]) << 24);
+        nHeader = 4;
+        return true;
+      }
+
+      // Varint. max 5 bytes for 32 bit length
+      nLength = 0;
+      for (DWORD i = 0; i < 5; i++)
+      {
+        if (pData + i >= pEnd)
+          return false;
+
+        // Only the low 4 bits of the 5th byte fit in 32 bits
+        if (i == 4 && (pData[i] & 0x70))
+          throw MZDataReaderException(ERROR_INVALID_DATA, "Invalid record length");
+
+        nLength |= static_cast<DWORD>(pData[i] & 0x7F) << (7 * i);
+        if ((pData[i] & 0x80) == 0)
+        {
+          nHeader = i + 1;
+          return true;
+        }
+      }
+
+      throw MZDataReaderException(ERROR_INVALID_DATA, "Invalid record length");
+    }
+
+    RecordFormat m_Format;
+    DWORD m_nRecordSize;
+    size_t m_ChunkSize = 256*1024;
+  };
+
+}
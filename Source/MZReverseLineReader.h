@@ -0,0 +1,246 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+
+#include "MZLineReader.h"
+#include "MZSimd.h"
+
+namespace MZDR
+{
+  //================================
+  // Read lines from the end of the data. Uses DataReader::ReadDataAtThrow to read chunks backwards.
+  //  Only the chunks that contain the lines are read. Cost is not related to the size of the data.
+  //  Lines are the same as when parsed forward with the same LineParser newline style.
+  // T MUST be char or wchar_t
+  //================================
+
+  template<class T, class TLinesData>
+  class ReverseLineReaderT : protected LineReaderT<T, TLinesData>
+  {
+  public:
+    void SetChunkSize(size_t nBytes) { m_nChunkSize = (nBytes / sizeof(T) > 0) ? (nBytes / sizeof(T)) * sizeof(T) : sizeof(T); }
+
+    // Call fn(const ParseLineResult& line) for each line from the last line to the first. Return false to stop.
+    //  Line data is only valid in fn
+    template<class F>
+    void ForEachLineReverse(MZDR::DataReader* pReader, MZDR::LineParser* pLineParser, F fn)
+    {
+      // Same policy as the forward parser. Styles without a policy of their own (like NoNewLine) are parsed as Unknown
+      const NewLine newLineStyle = pLineParser->WithNewLinePolicy([](auto policy) { return decltype(policy)::Style; });
+      const size_t nDataEnd = (pReader->TotalDataSize() / sizeof(T)) * sizeof(T);
+
+      Window window(pReader, nDataEnd, m_nChunkSize);
+      size_t nEnd = nDataEnd; // End of the next line (after the newline)
+
+      while (nEnd > 0)
+      {
+        // Need two characters before nEnd to find a CRLF
+        while (nEnd - window.Start() < 2 * sizeof(T) && window.Start() > 0)
+          window.ReadPrevChunk(nEnd);
+
+        BYTE nNewLineChars = 0;
+        NewLine newLine = NoNewLine;
+        GetNewLineAtEnd(newLineStyle, window.Ptr(window.Start()), window.Ptr(nEnd), nNewLineChars, newLine);
+
+        // Find the end of the line before. Read more data until it is found or start of data is reached
+        const T* pStart = nullptr;
+        for (;;)
+        {
+          pStart = FindLineStart(newLineStyle, window.Ptr(window.Start()), window.Ptr(nEnd) - nNewLineChars, window.Start() == 0);
+          if (pStart)
+            break;
+
+          window.ReadPrevChunk(nEnd);
+        }
+
+        const T* pLineEnd = window.Ptr(nEnd) - nNewLineChars;
+
+        MZDR::ParseLineResult result;
+        result.pLine = reinterpret_cast<const BYTE*>(pStart);
+        result.pNextLine = reinterpret_cast<const BYTE*>(window.Ptr(nEnd));
+        result.length = (pLineEnd - pStart) * sizeof(T);
+        result.nCharsForNewLine = nNewLineChars;
+        result.newLineChars = newLine;
+        result.bEndOfDataReached = (nEnd == nDataEnd);
+
+        if (fn(result) == false)
+          return;
+
+        nEnd = window.Offset(pStart);
+      }
+    }
+
+    // Last nLines lines in forward order. Only the data of the lines is read
+    std::shared_ptr<TLinesData> ReadLastLines(MZDR::DataReader* pReader, MZDR::LineParser* pLineParser, size_t nLines)
+    {
+      // Find the offset of the first line to return
+      const size_t nDataEnd = (pReader->TotalDataSize() / sizeof(T)) * sizeof(T);
+      size_t nStart = nDataEnd;
+      size_t nFound = 0;
+      if (nLines > 0)
+      {
+        ForEachLineReverse(pReader, pLineParser, [&](const MZDR::ParseLineResult& line)
+        {
+          nStart -= line.length + line.nCharsForNewLine * sizeof(T);
+          return ++nFound < nLines;
+        });
+      }
+
+      auto pLinesData = std::make_shared<TLinesData>();
+      pLinesData->ReserveLines(nFound);
+
+      // Read the data of the lines again and parse it forward. Lines are the same as found by the reverse scan
+      size_t nSize = nDataEnd - nStart;
+      if (nSize == 0)
+        return pLinesData;
+
+      BYTE* pBuffer = pLinesData->AllocateBuffer(nSize);
+      size_t nBytesRead = 0;
+      pReader->ReadDataAtThrow(nStart, pBuffer, nSize, &nBytesRead);
+      if (nBytesRead != nSize)
+        throw MZDataReaderException(ERROR_HANDLE_EOF, "Unexpected end of data");
+
+      this->ParseBuffert(pLinesData, pLineParser, pBuffer, pBuffer + nSize, true);
+      return pLinesData;
+    }
+
+  protected:
+    static const T CRChar = 0x0d;
+    static const T LFChar = 0x0a;
+
+    //================================
+    // Data from Start() to the end of the last line not returned yet. Chunks are added at the front
+    //================================
+
+    class Window
+    {
+    public:
+      Window(MZDR::DataReader* pReader, size_t nDataEnd, size_t nChunkSize)
+        : m_pReader(pReader)
+        , m_nStart(nDataEnd)
+        , m_nChunkSize(nChunkSize)
+      {
+      }
+
+      size_t Start() const { return m_nStart; }
+
+      const T* Ptr(size_t nOffset) const
+      {
+        return reinterpret_cast<const T*>(m_vBuffer.data() + m_nBufPos + (nOffset - m_nStart));
+      }
+
+      size_t Offset(const T* p) const
+      {
+        return m_nStart + (reinterpret_cast<const BYTE*>(p) - (m_vBuffer.data() + m_nBufPos));
+      }
+
+      // Read the chunk before Start(). Data after nEnd is not needed any more. Pointers are not valid after this
+      void ReadPrevChunk(size_t nEnd)
+      {
+        size_t nRead = (m_nStart < m_nChunkSize) ? m_nStart : m_nChunkSize;
+        size_t nUsed = nEnd - m_nStart;
+
+        if (m_nBufPos < nRead)
+        {
+          // Move used data to the end of the buffer. Grow the buffer if needed (line is larger then a chunk)
+          size_t nSize = m_vBuffer.size();
+          if (nSize < nUsed + nRead)
+            nSize = (nUsed + nRead) * 2;
+
+          std::vector<BYTE> vBuffer(nSize);
+          if (nUsed)
+            CopyMemory(vBuffer.data() + nSize - nUsed, m_vBuffer.data() + m_nBufPos, nUsed);
+
+          m_vBuffer.swap(vBuffer);
+          m_nBufPos = nSize - nUsed;
+        }
+
+        m_nBufPos -= nRead;
+        m_nStart -= nRead;
+
+        size_t nBytesRead = 0;
+        m_pReader->ReadDataAtThrow(m_nStart, m_vBuffer.data() + m_nBufPos, nRead, &nBytesRead);
+        if (nBytesRead != nRead)
+          throw MZDataReaderException(ERROR_HANDLE_EOF, "Unexpected end of data");
+      }
+
+    protected:
+      MZDR::DataReader* m_pReader;
+      std::vector<BYTE> m_vBuffer;
+      size_t m_nBufPos = 0;       // Position of Start() in m_vBuffer
+      size_t m_nStart;
+      size_t m_nChunkSize;
+    };
+
+    // Newline at the end of a line. Only the last line in the data can be without newline
+    static void GetNewLineAtEnd(NewLine newLineStyle, const T* pBegin, const T* pEnd, BYTE& nChars, NewLine& newLine)
+    {
+      nChars = 0;
+      newLine = NoNewLine;
+
+      T last = pEnd[-1];
+      bool bCRLF = (last == LFChar && pEnd - pBegin >= 2 && pEnd[-2] == CRChar);
+
+      if ((newLineStyle == CRLF || newLineStyle == Unknown) && bCRLF)
+      {
+        nChars = 2;
+        newLine = CRLF;
+      }
+      else if ((newLineStyle == LF || newLineStyle == Unknown) && last == LFChar)
+      {
+        nChars = 1;
+        newLine = LF;
+      }
+      else if ((newLineStyle == CR || newLineStyle == Unknown) && last == CRChar)
+      {
+        nChars = 1;
+        newLine = CR;
+      }
+    }
+
+    // Start of the line that ends at pEnd (newline not included).
+    //  Returns nullptr if more data before pBegin is needed to know
+    static const T* FindLineStart(NewLine newLineStyle, const T* pBegin, const T* pEnd, bool bStartOfData)
+    {
+      const T* pFound = nullptr;
+      if (newLineStyle == LF)
+        pFound = SimdHelperT<T>::FindLastOf(pBegin, pEnd, LFChar, LFChar);
+      else if (newLineStyle == CR)
+        pFound = SimdHelperT<T>::FindLastOf(pBegin, pEnd, CRChar, CRChar);
+      else if (newLineStyle == CRLF)
+      {
+        // LF is only a newline when it comes after CR
+        for (;;)
+        {
+          pFound = SimdHelperT<T>::FindLastOf(pBegin, pEnd, LFChar, LFChar);
+          if (pFound == nullptr)
+            break;
+
+          if (pFound == pBegin)
+          {
+            if (bStartOfData == false)
+              return nullptr; // CR can be in the chunk before
+            pFound = nullptr;
+            break;
+          }
+
+          if (pFound[-1] == CRChar)
+            break;
+
+          pEnd = pFound;
+        }
+      }
+      else
+        pFound = SimdHelperT<T>::FindLastOf(pBegin, pEnd, CRChar, LFChar);
+
+      if (pFound)
+        return pFound + 1;
+
+      return bStartOfData ? pBegin : nullptr;
+    }
+
+    size_t m_nChunkSize = 64 * 1024;
+  };
+
+}
@@ -0,0 +1,509 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <string>
+#include <new>
+#include <stdint.h>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+
+#include "MZLinesData.h"
+#include "MZDataReader.h"
+
+namespace MZDR
+{
+#ifdef _WIN32
+  typedef STLString SharedMemoryName;
+#else
+  typedef std::string SharedMemoryName; // Like "/mydata"
+#endif
+
+  //================================
+  // Named shared memory (CreateFileMapping / shm_open). On Linux also anonymous memfd segments.
+  //  Creator maps all of it read/write. Open() maps the header read/write and all of it read only
+  //================================
+
+  class SharedMemorySegment
+  {
+  public:
+    ~SharedMemorySegment()
+    {
+      Unmap();
+    }
+
+    SharedMemorySegment(const SharedMemorySegment&) = delete;
+    SharedMemorySegment& operator=(const SharedMemorySegment&) = delete;
+
+    static std::unique_ptr<SharedMemorySegment> Create(const SharedMemoryName& name, size_t nSize)
+    {
+      std::unique_ptr<SharedMemorySegment> spSegment(new SharedMemorySegment());
+      spSegment->m_nSize = nSize;
+
+#ifdef _WIN32
+      spSegment->m_hMapping = ::CreateFileMapping(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, static_cast<DWORD>(static_cast<uint64_t>(nSize) >> 32), static_cast<DWORD>(nSize), name.c_str());
+      if (spSegment->m_hMapping == NULL)
+        throw MZDataReaderException(::GetLastError(), "Unable to create shared memory");
+      if (::GetLastError() == ERROR_ALREADY_EXISTS)
+        throw MZDataReaderException(ERROR_ALREADY_EXISTS, "Shared memory already exists");
+
+      spSegment->m_pView = static_cast<BYTE*>(::MapViewOfFile(spSegment->m_hMapping, FILE_MAP_ALL_ACCESS, 0, 0, nSize));
+      if (spSegment->m_pView == nullptr)
+        throw MZDataReaderException(::GetLastError(), "Unable to map shared memory");
+#else
+      int fd = ::shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+      if (fd < 0)
+      {
+        std::string str = "Unable to create shared memory : ";
+        str += name;
+        throw MZDataReaderException(errno, str.c_str());
+      }
+
+      try
+      {
+        spSegment->MapNew(fd, nSize);
+      }
+      catch (...)
+      {
+        ::close(fd);
+        ::shm_unlink(name.c_str());
+        throw;
+      }
+      ::close(fd);
+#endif
+      spSegment->m_pHeader = spSegment->m_pView;
+      return spSegment;
+    }
+
+    // nHeaderSize is the part that is mapped writable
+    static std::unique_ptr<SharedMemorySegment> Open(const SharedMemoryName& name, size_t nHeaderSize)
+    {
+      std::unique_ptr<SharedMemorySegment> spSegment(new SharedMemorySegment());
+
+#ifdef _WIN32
+      spSegment->m_hMapping = ::OpenFileMapping(FILE_MAP_READ | FILE_MAP_WRITE, FALSE, name.c_str());
+      if (spSegment->m_hMapping == NULL)
+        throw MZDataReaderException(::GetLastError(), "Unable to open shared memory");
+
+      spSegment->m_pView = static_cast<BYTE*>(::MapViewOfFile(spSegment->m_hMapping, FILE_MAP_READ, 0, 0, 0));
+      if (spSegment->m_pView == nullptr)
+        throw MZDataReaderException(::GetLastError(), "Unable to map shared memory");
+
+      MEMORY_BASIC_INFORMATION info = { 0 };
+      ::VirtualQuery(spSegment->m_pView, &info, sizeof(info));
+      spSegment->m_nSize = info.RegionSize;
+      if (spSegment->m_nSize < nHeaderSize)
+        throw MZDataReaderException(ERROR_INVALID_DATA, "Shared memory is too small");
+
+      spSegment->m_pHeader = static_cast<BYTE*>(::MapViewOfFile(spSegment->m_hMapping, FILE_MAP_WRITE, 0, 0, nHeaderSize));
+      if (spSegment->m_pHeader == nullptr)
+        throw MZDataReaderException(::GetLastError(), "Unable to map shared memory");
+#else
+      int fd = ::shm_open(name.c_str(), O_RDWR, 0);
+      if (fd < 0)
+      {
+        std::string str = "Unable to open shared memory : ";
+        str += name;
+        throw MZDataReaderException(errno, str.c_str());
+      }
+
+      try
+      {
+        spSegment->MapExisting(fd, nHeaderSize);
+      }
+      catch (...)
+      {
+        ::close(fd);
+        throw;
+      }
+      ::close(fd);
+#endif
+      return spSegment;
+    }
+
+    static void Unlink(const SharedMemoryName& name)
+    {
+#ifdef _WIN32
+      (void)name; // Removed by the system when the last handle is closed
+#else
+      ::shm_unlink(name.c_str());
+#endif
+    }
+
+#ifdef __linux__
+    // Anonymous segment. Share Fd() with other processes (fork or unix socket) and use OpenFd()
+    static std::unique_ptr<SharedMemorySegment> CreateAnonymous(size_t nSize)
+    {
+      std::unique_ptr<SharedMemorySegment> spSegment(new SharedMemorySegment());
+      spSegment->m_nSize = nSize;
+
+      int fd = ::memfd_create("MZLinesData", MFD_CLOEXEC);
+      if (fd < 0)
+        throw MZDataReaderException(errno, "Unable to create memfd");
+
+      try
+      {
+        spSegment->MapNew(fd, nSize);
+      }
+      catch (...)
+      {
+        ::close(fd);
+        throw;
+      }
+
+      spSegment->m_fd = fd;
+      spSegment->m_pHeader = spSegment->m_pView;
+      return spSegment;
+    }
+
+    // fd is not closed
+    static std::unique_ptr<SharedMemorySegment> OpenFd(int fd, size_t nHeaderSize)
+    {
+      std::unique_ptr<SharedMemorySegment> spSegment(new SharedMemorySegment());
+      spSegment->MapExisting(fd, nHeaderSize);
+      return spSegment;
+    }
+
+    // memfd of a segment from CreateAnonymous(). -1 for named segments
+    int Fd() const { return m_fd; }
+#endif
+
+    BYTE* Header() { return m_pHeader; }
+    const BYTE* Data() const { return m_pView; }
+    size_t Size() const { return m_nSize; }
+
+    // Only for the creator
+    BYTE* WritableData() { return m_pView; }
+
+  protected:
+    SharedMemorySegment()
+    {
+    }
+
+#ifndef _WIN32
+    void MapNew(int fd, size_t nSize)
+    {
+      if (::ftruncate(fd, static_cast<off_t>(nSize)) != 0)
+        throw MZDataReaderException(errno, "Unable to set size of shared memory");
+
+      void* p = ::mmap(nullptr, nSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      if (p == MAP_FAILED)
+        throw MZDataReaderException(errno, "Unable to map shared memory");
+
+      m_pView = static_cast<BYTE*>(p);
+    }
+
+    void MapExisting(int fd, size_t nHeaderSize)
+    {
+      struct stat st;
+      if (::fstat(fd, &st) != 0)
+        throw MZDataReaderException(errno, "Unable to get size of shared memory");
+
+      m_nSize = static_cast<size_t>(st.st_size);
+      if (m_nSize < nHeaderSize)
+        throw MZDataReaderException(ERROR_INVALID_DATA, "Shared memory is too small");
+
+      void* p = ::mmap(nullptr, m_nSize, PROT_READ, MAP_SHARED, fd, 0);
+      if (p == MAP_FAILED)
+        throw MZDataReaderException(errno, "Unable to map shared memory");
+      m_pView = static_cast<BYTE*>(p);
+
+      p = ::mmap(nullptr, nHeaderSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      if (p == MAP_FAILED)
+        throw MZDataReaderException(errno, "Unable to map shared memory");
+      m_pHeader = static_cast<BYTE*>(p);
+      m_nHeaderSize = nHeaderSize;
+    }
+#endif
+
+    void Unmap()
+    {
+#ifdef _WIN32
+      if (m_pHeader && m_pHeader != m_pView)
+        ::UnmapViewOfFile(m_pHeader);
+      if (m_pView)
+        ::UnmapViewOfFile(m_pView);
+      if (m_hMapping)
+        ::CloseHandle(m_hMapping);
+      m_hMapping = NULL;
+#else
+      if (m_pHeader && m_pHeader != m_pView)
+        ::munmap(m_pHeader, m_nHeaderSize);
+      if (m_pView)
+        ::munmap(m_pView, m_nSize);
+      if (m_fd >= 0)
+        ::close(m_fd);
+      m_fd = -1;
+#endif
+      m_pHeader = nullptr;
+      m_pView = nullptr;
+    }
+
+#ifdef _WIN32
+    HANDLE m_hMapping = NULL;
+#else
+    int m_fd = -1;
+#endif
+    BYTE* m_pView = nullptr;
+    BYTE* m_pHeader = nullptr;
+    size_t m_nSize = 0;
+    size_t m_nHeaderSize = 0;
+  };
+
+  //================================
+  // LinesData in shared memory. One process publish the lines, other processes attach to them without copying or parsing.
+  //  Segment : header | line index (offset, length, newline) | line data
+  //  The index is position independent. Lines are made from the shared index and the mapping of each process when used.
+  //  Segment is reference counted and removed when the last view is destroyed
+  //  (a process that crash without destroying its view will keep the segment alive)
+  // T MUST be char or wchar_t
+  //================================
+
+  template<class T, class TLinesData>
+  class SharedLinesDataT
+  {
+  public:
+    typedef typename TLinesData::LineType Line;
+
+    // Copy all lines to a new named segment
+    static std::shared_ptr<SharedLinesDataT> Publish(const SharedMemoryName& name, TLinesData& linesData)
+    {
+      std::shared_ptr<SharedLinesDataT> spShared(new SharedLinesDataT());
+      spShared->m_spSegment = SharedMemorySegment::Create(name, SegmentSize(linesData));
+      spShared->m_Name = name;
+      spShared->m_bUnlinkOnDetach = true;
+      spShared->Fill(linesData);
+      return spShared;
+    }
+
+    static std::shared_ptr<SharedLinesDataT> Attach(const SharedMemoryName& name)
+    {
+      std::shared_ptr<SharedLinesDataT> spShared(new SharedLinesDataT());
+      spShared->m_spSegment = SharedMemorySegment::Open(name, sizeof(Header));
+      spShared->m_Name = name;
+      spShared->AddRef();
+      spShared->m_bUnlinkOnDetach = true;
+      spShared->MapIndex();
+      return spShared;
+    }
+
+#ifdef __linux__
+    // Copy all lines to an anonymous memfd segment. Share Fd() with the other processes
+    static std::shared_ptr<SharedLinesDataT> PublishAnonymous(TLinesData& linesData)
+    {
+      std::shared_ptr<SharedLinesDataT> spShared(new SharedLinesDataT());
+      spShared->m_spSegment = SharedMemorySegment::CreateAnonymous(SegmentSize(linesData));
+      spShared->Fill(linesData);
+      return spShared;
+    }
+
+    // fd is not closed
+    static std::shared_ptr<SharedLinesDataT> AttachFd(int fd)
+    {
+      std::shared_ptr<SharedLinesDataT> spShared(new SharedLinesDataT());
+      spShared->m_spSegment = SharedMemorySegment::OpenFd(fd, sizeof(Header));
+      spShared->AddRef();
+      spShared->MapIndex();
+      return spShared;
+    }
+
+    int Fd() const { return m_spSegment->Fd(); }
+#endif
+
+    ~SharedLinesDataT()
+    {
+      if (m_spSegment == nullptr || m_bAttached == false)
+        return;
+
+      if (--GetHeader()->nRefCount == 0 && m_bUnlinkOnDetach)
+        SharedMemorySegment::Unlink(m_Name);
+    }
+
+    SharedLinesDataT(const SharedLinesDataT&) = delete;
+    SharedLinesDataT& operator=(const SharedLinesDataT&) = delete;
+
+    size_t NumLines() const { return m_nLines; }
+
+    // Line points in to the mapping. Valid for as long as this view exists
+    Line GetLine(size_t nIdx) const
+    {
+      if (nIdx >= m_nLines)
+        throw MZDataReaderException(ERROR_INVALID_INDEX, "Line index out of range");
+
+      return MakeLine(m_pEntries[nIdx]);
+    }
+
+    // Call fn(const Line& line) for each line in order. Can be used with LineDataWriter::WriteLinesToDataWriter
+    template<class F>
+    void ForEachLine(F fn) const
+    {
+      for (size_t i = 0; i < m_nLines; i++)
+        fn(MakeLine(m_pEntries[i]));
+    }
+
+    MZDR::ContentFormat ContentFormat() const { return m_ContentFormat; }
+
+    // Number of views (in all processes) attached to the segment
+    DWORD NumAttached() { return GetHeader()->nRefCount.load(); }
+
+  protected:
+    static const uint32_t Magic = 0x4C535A4D; // "MZSL"
+    static const uint32_t Version = 1;
+
+    // std::atomic that is lock free is address free. Works between processes
+    struct Header
+    {
+      uint32_t nMagic;
+      uint32_t nVersion;
+      std::atomic<uint32_t> nRefCount;
+      uint32_t nCharSize;
+      uint32_t nContentFormat;
+      uint32_t nReserved;
+      uint64_t nLines;
+      uint64_t nIndexOffset;
+      uint64_t nDataOffset;
+      uint64_t nDataSize;
+      uint64_t nTotalSize;
+    };
+
+    struct LineEntry
+    {
+      uint64_t nOffset;
+      uint32_t nLength;
+      uint8_t newLine;
+      uint8_t nBytesForNewLine;
+      uint16_t nReserved;
+    };
+
+    SharedLinesDataT()
+    {
+    }
+
+    Header* GetHeader() { return reinterpret_cast<Header*>(m_spSegment->Header()); }
+
+    static size_t IndexOffset() { return (sizeof(Header) + 63) & ~static_cast<size_t>(63); }
+
+    static size_t SegmentSize(TLinesData& linesData)
+    {
+      return IndexOffset() + linesData.NumLines() * sizeof(LineEntry) + linesData.TotalLineSize(0) + DataSizeOfNewLines(linesData);
+    }
+
+    // Also check that all lines fit in LineEntry. Lines over 4 GB are not supported
+    static size_t DataSizeOfNewLines(TLinesData& linesData)
+    {
+      size_t nTotal = 0;
+      for (auto&& line : linesData.GetLines())
+      {
+        if (static_cast<uint64_t>(line.lenght) > 0xFFFFFFFF)
+          throw MZDataReaderException(ERROR_ARITHMETIC_OVERFLOW, "Line is too long for shared memory");
+        nTotal += line.nBytesForNewLine;
+      }
+      return nTotal;
+    }
+
+    void Fill(TLinesData& linesData)
+    {
+      BYTE* pSegment = m_spSegment->WritableData();
+      Header* pHeader = new (pSegment) Header();
+
+      pHeader->nVersion = Version;
+      pHeader->nRefCount = 1;
+      pHeader->nCharSize = sizeof(T);
+      pHeader->nContentFormat = linesData.ContentFormat();
+      pHeader->nLines = linesData.NumLines();
+      pHeader->nIndexOffset = IndexOffset();
+      pHeader->nDataOffset = IndexOffset() + pHeader->nLines * sizeof(LineEntry);
+      pHeader->nTotalSize = m_spSegment->Size();
+      pHeader->nDataSize = pHeader->nTotalSize - pHeader->nDataOffset;
+
+      LineEntry* pEntry = reinterpret_cast<LineEntry*>(pSegment + pHeader->nIndexOffset);
+      BYTE* pData = pSegment + pHeader->nDataOffset;
+      uint64_t nOffset = 0;
+      for (auto&& line : linesData.GetLines())
+      {
+        size_t nBytes = static_cast<size_t>(line.lenght) + line.nBytesForNewLine;
+        CopyMemory(pData + nOffset, line.pLine, nBytes);
+
+        pEntry->nOffset = nOffset;
+        pEntry->nLength = static_cast<uint32_t>(line.lenght);
+        pEntry->newLine = static_cast<uint8_t>(LineHelper<T>::GetLineNewLine(line));
+        pEntry->nBytesForNewLine = line.nBytesForNewLine;
+        pEntry->nReserved = 0;
+        pEntry++;
+
+        nOffset += nBytes;
+      }
+
+      // Other processes do not use the segment before the magic is set
+      std::atomic_thread_fence(std::memory_order_release);
+      pHeader->nMagic = Magic;
+
+      m_bAttached = true;
+      MapIndex();
+    }
+
+    void AddRef()
+    {
+      Header* pHeader = GetHeader();
+      if (pHeader->nMagic != Magic)
+        throw MZDataReaderException(ERROR_INVALID_DATA, "Shared memory do not contain lines or is not ready");
+      std::atomic_thread_fence(std::memory_order_acquire);
+
+      if (pHeader->nVersion != Version || pHeader->nCharSize != sizeof(T))
+        throw MZDataReaderException(ERROR_INVALID_DATA, "Shared lines has wrong version or character size");
+
+      // Do not attach if the last view is detaching
+      uint32_t nRefCount = pHeader->nRefCount.load();
+      do
+      {
+        if (nRefCount == 0)
+          throw MZDataReaderException(ERROR_INVALID_DATA, "Shared lines is being removed");
+      } while (pHeader->nRefCount.compare_exchange_weak(nRefCount, nRefCount + 1) == false);
+
+      m_bAttached = true;
+    }
+
+    void MapIndex()
+    {
+      const Header* pHeader = reinterpret_cast<const Header*>(m_spSegment->Data());
+      if (pHeader->nTotalSize > m_spSegment->Size() || pHeader->nDataOffset + pHeader->nDataSize > pHeader->nTotalSize
+        || pHeader->nIndexOffset + pHeader->nLines * sizeof(LineEntry) > pHeader->nDataOffset)
+        throw MZDataReaderException(ERROR_INVALID_DATA, "Shared lines header is invalid");
+
+      m_ContentFormat = static_cast<MZDR::ContentFormat>(pHeader->nContentFormat);
+      m_pEntries = reinterpret_cast<const LineEntry*>(m_spSegment->Data() + pHeader->nIndexOffset);
+      m_pData = m_spSegment->Data() + pHeader->nDataOffset;
+      m_nDataSize = pHeader->nDataSize;
+      m_nLines = static_cast<size_t>(pHeader->nLines);
+    }
+
+    // Entries are checked when used. The index is never copied or scanned
+    Line MakeLine(const LineEntry& entry) const
+    {
+      if (entry.nOffset > m_nDataSize || m_nDataSize - entry.nOffset < static_cast<uint64_t>(entry.nLength) + entry.nBytesForNewLine)
+        throw MZDataReaderException(ERROR_INVALID_DATA, "Shared lines index is invalid");
+
+      return Line(m_pData + entry.nOffset, entry.nLength, static_cast<NewLine>(entry.newLine), entry.nBytesForNewLine);
+    }
+
+    std::unique_ptr<SharedMemorySegment> m_spSegment;
+    SharedMemoryName m_Name;
+    bool m_bUnlinkOnDetach = false;
+    bool m_bAttached = false;
+
+    // In the mapping
+    const LineEntry* m_pEntries = nullptr;
+    const BYTE* m_pData = nullptr;
+    uint64_t m_nDataSize = 0;
+    size_t m_nLines = 0;
+    MZDR::ContentFormat m_ContentFormat = MZDR::ContentUnknown;
+  };
+
+}
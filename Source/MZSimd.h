@@ -0,0 +1,211 @@
+#pragma once
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#define MZDR_USE_SSE2
+#include <emmintrin.h>
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace MZDR
+{
+  //================================
+  // SIMD helper for the scanning kernels
+  // Works on blocks of 16 characters. Falls back to scalar code when SSE2 is not available
+  // T MUST be char or wchar_t
+  //================================
+
+  template<class T>
+  class SimdHelperT
+  {
+  public:
+    static const DWORD BlockChars = 16;
+
+    // Returns a mask where bit N is set if character N in the block is equal to ch.
+    // pBlock MUST point to at least BlockChars readable characters
+    static DWORD MatchMask(const T* pBlock, T ch)
+    {
+#ifdef MZDR_USE_SSE2
+      if (sizeof(T) == 1)
+      {
+        __m128i vCh = _mm_set1_epi8(static_cast<char>(ch));
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pBlock));
+        return static_cast<DWORD>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, vCh)));
+      }
+      if (sizeof(T) == 2)
+      {
+        __m128i vCh = _mm_set1_epi16(static_cast<short>(ch));
+        __m128i v0 = _mm_cmpeq_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(pBlock)), vCh);
+        __m128i v1 = _mm_cmpeq_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(pBlock + 8)), vCh);
+        return static_cast<DWORD>(_mm_movemask_epi8(_mm_packs_epi16(v0, v1)));
+      }
+      if (sizeof(T) == 4)
+      {
+        __m128i vCh = _mm_set1_epi32(static_cast<int>(ch));
+        __m128i v0 = _mm_cmpeq_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(pBlock)), vCh);
+        __m128i v1 = _mm_cmpeq_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(pBlock + 4)), vCh);
+        __m128i v2 = _mm_cmpeq_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(pBlock + 8)), vCh);
+        __m128i v3 = _mm_cmpeq_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(pBlock + 12)), vCh);
+        return static_cast<DWORD>(_mm_movemask_epi8(_mm_packs_epi16(_mm_packs_epi32(v0, v1), _mm_packs_epi32(v2, v3))));
+      }
+#endif
+      DWORD mask = 0;
+      for (DWORD i = 0; i < BlockChars; i++)
+      {
+        if (pBlock[i] == ch)
+          mask |= (1 << i);
+      }
+      return mask;
+    }
+
+    // Index of the lowest set bit. mask MUST NOT be 0
+    static DWORD LowestBit(DWORD mask)
+    {
+#ifdef _MSC_VER
+      unsigned long idx = 0;
+      _BitScanForward(&idx, mask);
+      return idx;
+#else
+      return static_cast<DWORD>(__builtin_ctz(mask));
+#endif
+    }
+
+    // Index of the highest set bit. mask MUST NOT be 0
+    static DWORD HighestBit(DWORD mask)
+    {
+#ifdef _MSC_VER
+      unsigned long idx = 0;
+      _BitScanReverse(&idx, mask);
+      return idx;
+#else
+      return static_cast<DWORD>(31 - __builtin_clz(mask));
+#endif
+    }
+
+    static DWORD PopCount(DWORD mask)
+    {
+#ifdef _MSC_VER
+      return __popcnt(mask);
+#else
+      return static_cast<DWORD>(__builtin_popcount(mask));
+#endif
+    }
+
+    // Bit N in result is the XOR of bit 0..N in mask. Used to find characters inside quotes
+    static DWORD PrefixXor(DWORD mask)
+    {
+      mask ^= mask << 1;
+      mask ^= mask << 2;
+      mask ^= mask << 4;
+      mask ^= mask << 8;
+      return mask & 0xFFFF;
+    }
+
+    // Find first character that is a or b. Returns pEnd if not found
+    static const T* FindFirstOf(const T* pData, const T* pEnd, T a, T b)
+    {
+      while (pData + BlockChars <= pEnd)
+      {
+        DWORD mask = MatchMask(pData, a) | MatchMask(pData, b);
+        if (mask)
+          return pData + LowestBit(mask);
+
+        pData += BlockChars;
+      }
+
+      while (pData < pEnd && *pData != a && *pData != b)
+        pData++;
+
+      return pData;
+    }
+
+    // Find last character that is a or b. Returns nullptr if not found
+    static const T* FindLastOf(const T* pData, const T* pEnd, T a, T b)
+    {
+      while (pEnd - pData >= static_cast<ptrdiff_t>(BlockChars))
+      {
+        pEnd -= BlockChars;
+        DWORD mask = MatchMask(pEnd, a) | MatchMask(pEnd, b);
+        if (mask)
+          return pEnd + HighestBit(mask);
+      }
+
+      while (pEnd > pData)
+      {
+        --pEnd;
+        if (*pEnd == a || *pEnd == b)
+          return pEnd;
+      }
+
+      return nullptr;
+    }
+
+    // Count number of ch in data
+    static size_t Count(const T* pData, const T* pEnd, T ch)
+    {
+      size_t nCount = 0;
+      while (pData + BlockChars <= pEnd)
+      {
+        nCount += PopCount(MatchMask(pData, ch));
+        pData += BlockChars;
+      }
+
+      for (; pData < pEnd; pData++)
+      {
+        if (*pData == ch)
+          nCount++;
+      }
+      return nCount;
+    }
+
+    // Count number of LF, CR and CRLF. (CRLF is counted once)
+    static size_t CountNewLines(const T* pData, const T* pEnd)
+    {
+      const T LF = 0x0a;
+      const T CR = 0x0d;
+
+      size_t nCount = 0;
+      while (pData + BlockChars < pEnd)
+      {
+        DWORD nLFMask = MatchMask(pData, LF);
+        DWORD nCRMask = MatchMask(pData, CR);
+
+        // CR followed by LF is counted by the LF. Next block is checked for LF after last CR
+        DWORD nLFAfter = (nLFMask >> 1) | (pData[BlockChars] == LF ? 0x8000 : 0);
+        nCount += PopCount(nLFMask) + PopCount(nCRMask & ~nLFAfter);
+
+        pData += BlockChars;
+      }
+
+      for (; pData < pEnd; pData++)
+      {
+        if (*pData == LF)
+          nCount++;
+        else if (*pData == CR && (pData + 1 == pEnd || *(pData + 1) != LF))
+          nCount++;
+      }
+      return nCount;
+    }
+
+    // Count number of a directly followed by b
+    static size_t CountPairs(const T* pData, const T* pEnd, T a, T b)
+    {
+      size_t nCount = 0;
+      while (pData + BlockChars < pEnd)
+      {
+        nCount += PopCount(MatchMask(pData, a) & MatchMask(pData + 1, b));
+        pData += BlockChars;
+      }
+
+      for (; pData + 1 < pEnd; pData++)
+      {
+        if (*pData == a && *(pData + 1) == b)
+          nCount++;
+      }
+      return nCount;
+    }
+  };
+
+}
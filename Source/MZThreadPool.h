@@ -0,0 +1,111 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <functional>
+#include <memory>
+
+namespace MZDR
+{
+  //================================
+  // Fixed size thread pool
+  //  Exceptions thrown by a task (like MZDataReaderException) are rethrown when calling get() on the returned future
+  //================================
+
+  class ThreadPool
+  {
+  public:
+    // nThreads = 0 will use one thread per core
+    ThreadPool(size_t nThreads = 0)
+    {
+      if (nThreads == 0)
+        nThreads = DefaultThreadCount();
+
+      for (size_t i = 0; i < nThreads; i++)
+        m_vThreads.emplace_back([this] { WorkerThread(); });
+    }
+
+    ~ThreadPool()
+    {
+      {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_bStop = true;
+      }
+      m_Condition.notify_all();
+
+      for (auto&& thread : m_vThreads)
+        thread.join();
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    static size_t DefaultThreadCount()
+    {
+      size_t nThreads = std::thread::hardware_concurrency();
+      return nThreads > 0 ? nThreads : 1;
+    }
+
+    size_t NumThreads() const { return m_vThreads.size(); }
+
+    template<class F>
+    auto Submit(F&& fn) -> std::future<decltype(fn())>
+    {
+      typedef decltype(fn()) R;
+      auto spTask = std::make_shared<std::packaged_task<R()>>(std::forward<F>(fn));
+      auto future = spTask->get_future();
+      {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Tasks.emplace_back([spTask] { (*spTask)(); });
+      }
+      m_Condition.notify_one();
+      return future;
+    }
+
+    // Call fn(i) for i = 0 to nCount-1 on the pool and wait for all to finish. First exception is rethrown
+    template<class F>
+    void ParallelFor(size_t nCount, F fn)
+    {
+      std::vector<std::future<void>> vFutures;
+      vFutures.reserve(nCount);
+      for (size_t i = 0; i < nCount; i++)
+        vFutures.push_back(Submit([&fn, i] { fn(i); }));
+
+      for (auto&& future : vFutures)
+        future.wait();
+
+      for (auto&& future : vFutures)
+        future.get();
+    }
+
+  protected:
+    void WorkerThread()
+    {
+      for (;;)
+      {
+        std::function<void()> task;
+        {
+          std::unique_lock<std::mutex> lock(m_Mutex);
+          m_Condition.wait(lock, [this] { return m_bStop || m_Tasks.empty() == false; });
+          if (m_Tasks.empty())
+            return; // stopped and no more work
+
+          task = std::move(m_Tasks.front());
+          m_Tasks.pop_front();
+        }
+        task();
+      }
+    }
+
+    std::vector<std::thread> m_vThreads;
+    std::deque<std::function<void()>> m_Tasks;
+    std::mutex m_Mutex;
+    std::condition_variable m_Condition;
+    bool m_bStop = false;
+  };
+
+}